@@ -9,39 +9,165 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <xcb/xcb.h>
 #include <xcb/xcbext.h>
 #if WITH_XINERAMA
 #include <xcb/xinerama.h>
 #endif
 #include <xcb/randr.h>
+#if WITH_SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <xcb/shm.h>
+#endif
+#if WITH_RENDER
+#include <xcb/render.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <fontconfig/fontconfig.h>
+#endif
 #include "utils.h"
+#include "utf8.h"
+#include "lemonbar_ring.h"
 
 // Here be dragons
 
 #define max(a,b) ((a) > (b) ? (a) : (b))
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
+// The glyph tables are split in pages of 256 characters covering the whole
+// Unicode range
+#define GLYPH_PAGES (0x110000 >> 8)
+// Zero is a valid advance for the combining marks
+#define ADVANCE_UNKNOWN -1
+#define ADVANCE_MISSING -2
+
+// A glyph coverage mask used when drawing on the client side, the bitmap is
+// placed at x pixels from the pen position and its top row is y pixels above
+// the baseline.
+typedef struct glyph_t {
+    bool loaded;
+    int16_t x, y;
+    uint16_t width, height;
+    uint8_t *data;
+} glyph_t;
+
+// A run of consecutive characters sharing the same width
+typedef struct width_run_t {
+    uint16_t first;
+    int16_t width;
+} width_run_t;
+
+enum {
+    METRICS_CONSTANT = 0,
+    METRICS_RUNS,
+    METRICS_INT8,
+    METRICS_INT16,
+};
+
+// The header of a metrics cache file, it's followed by the key (the font name
+// and the server font path), the width table and the coverage bitmap, each one
+// starting at a 8-byte boundary.
+#define FONT_CACHE_MAGIC 0x43464c42 // "BLFC"
+#define FONT_CACHE_VERSION 1
+
+typedef struct font_cache_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t key_len;
+    int16_t ascent, descent;
+    int16_t lbearing, rbearing;
+    int16_t width;
+    uint16_t char_min, char_max;
+    uint16_t metrics;
+    uint32_t run_count;
+    uint32_t widths_len;
+    uint32_t present_len;
+} font_cache_t;
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
 typedef struct font_t {
     xcb_font_t ptr;
+    // The name given on the command line
+    char *pattern;
+    // Set for the core fonts that will be opened on demand
+    bool pending;
     int descent, height, width;
+    // The real ascent and the ink extents of the core fonts
+    int ascent, lbearing, rbearing;
+    // The glyph bitmaps drawn with -x, both the page table and the pages are
+    // allocated on demand
+    glyph_t **bitmaps;
     uint16_t char_max;
     uint16_t char_min;
-    xcb_charinfo_t *width_lut;
+    // The widths of the characters, indexed from char_min. A zero width
+    // marks a missing glyph, when all the glyphs have the same width only the
+    // coverage bitmap is kept (or nothing at all if there are no holes).
+    int metrics;
+    union {
+        width_run_t *runs;
+        int8_t *w8;
+        int16_t *w16;
+    } widths;
+    unsigned run_count;
+    uint8_t *present;
+    // The file mapping the width tables point into, if they come from the
+    // metrics cache
+    void *cache;
+    size_t cache_size;
+#if WITH_RENDER
+    // Outline fonts are rasterized on demand and kept in a server-side
+    // glyphset, the advances are kept in pages too, ADVANCE_UNKNOWN marks the
+    // characters that haven't been looked up yet and ADVANCE_MISSING the ones
+    // the font has no glyph for.
+    FT_Face face;
+    xcb_render_glyphset_t glyphset;
+    int16_t *advance[GLYPH_PAGES];
+#endif
 } font_t;
 
+typedef struct span_t {
+    int begin, end;
+} span_t;
+
 typedef struct monitor_t {
     char *name;
     int x, y, width, height;
     xcb_window_t window;
     xcb_pixmap_t pixmap;
     struct monitor_t *prev, *next;
+    // Horizontal stripes of the pixmap that have to be copied on the window
+    span_t *dirty;
+    unsigned dirty_count, dirty_alloc;
+    // The client side copy of the pixmap, only used with -x
+    uint32_t *image;
+#if WITH_SHM
+    xcb_shm_seg_t shmseg;
+#endif
+    // The monitor showing the same content, its pixmap is shared with this one
+    struct monitor_t *mirror;
+    // Order-independent hash of the segments drawn on the monitor
+    uint64_t content;
 } monitor_t;
 
 typedef struct area_t {
     unsigned begin;
     unsigned end;
+    unsigned block_begin;
+    unsigned block_end;
+    // Offset in the line of the block closing the area
+    size_t closed_at;
     bool complete;
     unsigned align;
     unsigned button;
@@ -64,6 +190,164 @@ typedef struct area_stack_t {
     unsigned int index, alloc;
 } area_stack_t;
 
+// A stretch of the input sharing the same monitor and alignment, its position
+// on the screen is known only once the whole line has been measured.
+typedef struct block_t {
+    monitor_t *mon;
+    int align;
+    int width;
+    int origin;
+} block_t;
+
+enum {
+    SEG_TEXT = 0,
+    SEG_SPACE,
+    SEG_LINES,
+};
+
+typedef struct seg_t {
+    int type;
+    unsigned block;
+    // Offset from the block origin, SEG_LINES segments use it to store the
+    // absolute position the lines are extended to.
+    int x, width;
+    font_t *font;
+    rgba_t fg, bg, ul;
+    uint32_t attrs;
+    bool wide;
+    unsigned glyph_begin, glyph_len;
+    // Absolute extent and position-independent content hash, filled by
+    // layout_resolve
+    int left, right;
+    uint64_t hash;
+} seg_t;
+
+typedef struct layout_t {
+    block_t *blocks;
+    unsigned block_count, block_alloc;
+    seg_t *segs;
+    unsigned seg_count, seg_alloc;
+    uint32_t *glyphs;
+    unsigned glyph_count, glyph_alloc;
+} layout_t;
+
+// Pre-rendered text segments, indexed by their content hash.
+typedef struct cache_entry_t {
+    uint64_t key;
+    int width;
+    xcb_pixmap_t pixmap;
+    // Hash bucket chain
+    struct cache_entry_t *hnext;
+    // LRU list, the most recently used entry is the head
+    struct cache_entry_t *prev, *next;
+} cache_entry_t;
+
+#define CACHE_BUCKETS 256
+#define CACHE_ENTRIES_MAX 1024
+
+typedef struct cache_t {
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *head, *tail;
+    unsigned entries;
+    size_t size, limit;
+    unsigned long hits, misses;
+} cache_t;
+
+// The parser state at the beginning of a formatting block, the line is parsed
+// again starting from the last checkpoint placed before the first byte that
+// differs from the previous line.
+typedef struct checkpoint_t {
+    size_t offset;
+    rgba_t fgc, bgc, ugc;
+    uint32_t attrs;
+    int font_index;
+    monitor_t *mon;
+    unsigned block;
+    int pos_x, align;
+    unsigned area_index;
+    unsigned block_count, seg_count, glyph_count;
+} checkpoint_t;
+
+// The operations a template given with -t or a binary frame is turned into,
+// every formatting command has its arguments parsed once
+enum {
+    OP_TEXT,
+    OP_SLOT,
+    OP_ATTR,
+    OP_SWAP,
+    OP_ALIGN,
+    OP_AREA,
+    OP_AREA_END,
+    OP_BGC,
+    OP_FGC,
+    OP_UGC,
+    OP_MONITOR,
+    OP_OFFSET,
+    OP_FONT,
+    OP_PROVIDER,
+};
+
+typedef struct op_t {
+    int type;
+    // The slot index, alignment, button, width, font or provider index
+    int arg;
+    // The attribute modifier and name
+    char mod, attr;
+    rgba_t color;
+    // The area command or the monitor specifier, NULL for a numbered monitor
+    char *str;
+    size_t len;
+    // The literal text
+    uint32_t *ucs;
+} op_t;
+
+typedef struct op_list_t {
+    op_t *ptr;
+    unsigned count, alloc;
+} op_list_t;
+
+// A decoded binary frame, the operations point in its text and commands
+typedef struct bin_frame_t {
+    op_list_t ops;
+    uint32_t *ucs;
+    size_t ucs_alloc;
+    char *strs;
+    size_t strs_alloc;
+} bin_frame_t;
+
+// The value of a slot, pointing in the input line
+typedef struct slot_t {
+    const char *str;
+    size_t len;
+} slot_t;
+
+struct prov_t;
+
+// A source of data drawn in place of the %{P:name} blocks, the update
+// callback fills the text and returns false if the data couldn't be read
+typedef struct provider_t {
+    const char *name;
+    // The refresh interval in seconds
+    int interval;
+    bool (*update)(struct prov_t *p);
+} provider_t;
+
+// A provider along with its argument, shared by the blocks asking for the same
+typedef struct prov_t {
+    const provider_t *type;
+    char *arg;
+    char text[64];
+    int interval;
+    // The counters read on the previous update and when that happened
+    uint64_t last[2];
+    struct timespec last_time;
+    struct timespec next;
+    // The offset of its first block in the line, SIZE_MAX if the line has none
+    size_t offset;
+    bool in_tmpl;
+    bool failed;
+} prov_t;
+
 enum {
     ATTR_OVERL = (1<<0),
     ATTR_UNDERL = (1<<1),
@@ -75,30 +359,211 @@ enum {
     ALIGN_R
 };
 
-enum {
-    GC_DRAW = 0,
-    GC_CLEAR,
-    GC_ATTR,
-    GC_MAX
-};
+// Graphic contexts are picked from a pool according to the foreground color
+// and font, a GC with no font can be used for filling only.
+typedef struct gc_entry_t {
+    xcb_gcontext_t gc;
+    uint32_t color;
+    xcb_font_t font;
+    unsigned long last_use;
+} gc_entry_t;
+
+#define GC_POOL_SIZE 64
+
+// The values of font_map entries that don't refer to a font
+#define FONT_MAP_UNKNOWN 0xff
+#define FONT_MAP_NONE 0xfe
+#define FONT_MAX FONT_MAP_NONE
+
+#if WITH_RENDER
+// Solid color pictures used as source when compositing the glyphs
+typedef struct pen_t {
+    xcb_render_picture_t pict;
+    uint32_t color;
+    unsigned long last_use;
+} pen_t;
+
+#define PEN_POOL_SIZE 16
+#endif
 
 static xcb_connection_t *c;
 static xcb_screen_t *scr;
-static xcb_gcontext_t gc[GC_MAX];
+static xcb_gcontext_t gc_copy;
+static gc_entry_t gc_pool[GC_POOL_SIZE];
+static unsigned gc_pool_count;
+static unsigned long gc_clock;
+#if WITH_RENDER
+static FT_Library ft_lib;
+static xcb_render_pictformat_t fmt_a8, fmt_visual;
+static pen_t pen_pool[PEN_POOL_SIZE];
+static unsigned pen_pool_count;
+#endif
 static xcb_visualid_t visual;
+static uint8_t depth;
 static xcb_colormap_t colormap;
 static monitor_t *monhead, *montail;
+// The monitors of the previous configuration while a new one is being set up
+static monitor_t *mon_stale;
+// The first RandR event code, zero unless the monitor changes are tracked
+static uint8_t randr_base;
 static font_t **font_list = NULL;
 static int font_count = 0;
 static int font_index = -1;
+// The index of the first font able to draw a given codepoint, the pages are
+// filled as the codepoints show up.
+static uint8_t *font_map[GLYPH_PAGES];
+// The server font path, part of the metrics cache key
+static char *font_path;
 static uint32_t attrs = 0;
 static bool dock = false;
 static bool topbar = true;
 static int bw = -1, bh = -1, bx = 0, by = 0;
+// The width given with -g, the actual one depends on the monitors
+static int bw_geom = -1;
+static char *wm_name = NULL;
 static int bu = 1; // Underline height
 static rgba_t fgc, bgc, ugc;
 static rgba_t dfgc, dbgc, dugc;
 static area_stack_t area_stack;
+// The layout of the current line and the one of the line being displayed
+static layout_t layouts[2];
+static layout_t *lay = &layouts[0], *prev_lay = &layouts[1];
+static cache_t cache = { .limit = 2048 * 1024 };
+static volatile sig_atomic_t dump_stats = false;
+// Set by SIGINT and SIGTERM, the main loop is left and the resources are
+// released outside of the signal handler
+static volatile sig_atomic_t quit = false;
+// The data read from stdin, the bytes in [head, tail) are yet to be parsed.
+// The buffer grows as needed up to the line size limit set with -L
+static struct {
+    char *buf;
+    size_t head, tail, alloc, limit;
+    // Set while the rest of a line that's too long is being skipped
+    bool skipping;
+    // The bytes left of a binary frame that's too large
+    size_t skip;
+    // Set once the end of the input is reached
+    bool eof;
+    unsigned long lines, superseded, dropped;
+} input = { .limit = 64 * 1024 };
+// The frame rate cap set with -r, the newest line read while a frame interval
+// is running is held back until its end
+static struct {
+    long interval; // In ns, 0 if uncapped
+    struct timespec next;
+    bool armed;
+    char *line;
+    size_t len, alloc;
+    bool pending;
+} frame;
+
+// A piece of the line defined through the control socket, the line is made of
+// all of them in the order they were defined
+typedef struct named_block_t {
+    char *name;
+    char *text;
+} named_block_t;
+
+#define CTL_CLIENTS 16
+
+typedef struct ctl_client_t {
+    char *buf;
+    size_t len, alloc;
+    // The descriptors received along with the commands, until one takes them
+    int fds[2];
+    unsigned fd_count;
+    // The shared memory ring attached with the ring command, its wakeup
+    // descriptor and the block it feeds
+    struct lemonbar_ring *ring;
+    uint64_t ring_size, ring_tail;
+    int ring_fd;
+    char *ring_block;
+#ifndef F_GET_SEALS
+    // The ring memory, its size is checked before every read as it can't be
+    // sealed against shrinking
+    int ring_mem;
+#endif
+} ctl_client_t;
+
+// The control socket set with -s
+static struct {
+    char *path;
+    int fd;
+    ctl_client_t clients[CTL_CLIENTS];
+    named_block_t *blocks;
+    unsigned block_count, block_alloc;
+    // Set when a block changed and the line has to be put together again
+    bool dirty;
+    char *line;
+    size_t line_alloc;
+} ctl = { .fd = -1 };
+// Draw on the client side and upload the result
+static bool client_render = false;
+// The threads drawing the monitors in parallel
+static int thread_count = 0;
+static struct {
+    pthread_t *threads;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    // Bumped every time a new frame is ready to be drawn
+    unsigned long frame;
+    const layout_t *layout;
+    monitor_t *next;
+    int busy;
+    bool quit;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+#if WITH_SHM
+static bool shm_ok = false;
+// Set when the server may still be reading from the shared segments
+static bool shm_busy = false;
+#endif
+
+// The last line parsed and a copy of it that's modified in place by the
+// parser, the clickable areas commands point in the latter.
+static char *line_prev, *line_buf;
+static size_t line_len, line_alloc;
+static bool line_valid = false;
+static checkpoint_t *ckpts;
+static unsigned ckpt_count, ckpt_alloc;
+// The codepoints of the text run being parsed
+static uint32_t *ucs_buf;
+static size_t ucs_alloc;
+// The template set with -t and the last line drawn with it
+static struct {
+    char *src;
+    op_list_t ops;
+    slot_t *slots;
+    unsigned slot_count;
+    char delim;
+    char *line;
+    size_t line_len, line_alloc;
+    bool valid;
+} tmpl = { .delim = '\t' };
+// The binary frames read with -i binary, the frame being drawn, the one being
+// decoded and a copy of the former. The two are swapped once the new frame
+// turns out to be valid, the areas on screen point in the one being drawn.
+static struct {
+    bool enabled;
+    bin_frame_t cur, next;
+    char *frame;
+    size_t frame_len, frame_alloc;
+    bool valid;
+} bin;
+// The providers referenced so far, the line is parsed again from the first
+// block whose text changed and that's where parse() resumes from. A template
+// is run again as a whole
+static struct {
+    prov_t *ptr;
+    unsigned count, alloc;
+    size_t dirty_from;
+    char *line;
+    size_t line_alloc;
+} provs = { .dirty_from = SIZE_MAX };
 
 static const rgba_t BLACK = (rgba_t){ .r = 0, .g = 0, .b = 0, .a = 255 };
 static const rgba_t WHITE = (rgba_t){ .r = 255, .g = 255, .b = 255, .a = 255 };
@@ -106,12 +571,57 @@ static const rgba_t WHITE = (rgba_t){ .r = 255, .g = 255, .b = 255, .a = 255 };
 static int num_outputs = 0;
 static char **output_names = NULL;
 
-void
-update_gc (void)
+// The outputs declared as mirrors with -m, along with their group
+static int num_mirrors = 0, num_mirror_groups = 0;
+static char **mirror_names = NULL;
+static int *mirror_groups = NULL;
+
+static rgba_t *palette = NULL;
+static unsigned palette_count = 0;
+
+// Return a GC whose foreground is set to the given color, the font is set as
+// well if one is given. The least recently used GC is recycled once the pool
+// is full.
+xcb_gcontext_t
+gc_get (const rgba_t color, const font_t *font)
 {
-    xcb_change_gc(c, gc[GC_DRAW], XCB_GC_FOREGROUND, (const uint32_t []){ fgc.v });
-    xcb_change_gc(c, gc[GC_CLEAR], XCB_GC_FOREGROUND, (const uint32_t []){ bgc.v });
-    xcb_change_gc(c, gc[GC_ATTR], XCB_GC_FOREGROUND, (const uint32_t []){ ugc.v });
+    const xcb_font_t fid = font ? font->ptr : XCB_NONE;
+    gc_entry_t *e, *lru = &gc_pool[0];
+
+    for (unsigned i = 0; i < gc_pool_count; i++) {
+        e = &gc_pool[i];
+        if (e->color == color.v && (fid == XCB_NONE || e->font == fid)) {
+            e->last_use = ++gc_clock;
+            return e->gc;
+        }
+        if (e->last_use < lru->last_use)
+            lru = e;
+    }
+
+    if (gc_pool_count < GC_POOL_SIZE) {
+        e = &gc_pool[gc_pool_count++];
+        e->gc = xcb_generate_id(c);
+        e->font = fid;
+        e->color = color.v;
+        if (fid != XCB_NONE)
+            xcb_create_gc(c, e->gc, monhead->pixmap, XCB_GC_FOREGROUND | XCB_GC_FONT | XCB_GC_GRAPHICS_EXPOSURES,
+                    (const uint32_t []){ color.v, fid, 0 });
+        else
+            xcb_create_gc(c, e->gc, monhead->pixmap, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES,
+                    (const uint32_t []){ color.v, 0 });
+    } else {
+        e = lru;
+        e->color = color.v;
+        if (fid != XCB_NONE) {
+            e->font = fid;
+            xcb_change_gc(c, e->gc, XCB_GC_FOREGROUND | XCB_GC_FONT, (const uint32_t []){ color.v, fid });
+        } else {
+            xcb_change_gc(c, e->gc, XCB_GC_FOREGROUND, (const uint32_t []){ color.v });
+        }
+    }
+
+    e->last_use = ++gc_clock;
+    return e->gc;
 }
 
 void
@@ -120,23 +630,47 @@ fill_rect (xcb_drawable_t d, xcb_gcontext_t _gc, int x, int y, int width, int he
     xcb_poly_fill_rectangle(c, d, _gc, 1, (const xcb_rectangle_t []){ { x, y, width, height } });
 }
 
-// Apparently xcb cannot seem to compose the right request for this call, hence we have to do it by
-// ourselves.
-// The funcion is taken from 'wmdia' (http://wmdia.sourceforge.net/)
-xcb_void_cookie_t xcb_poly_text_16_simple(xcb_connection_t * c,
-    xcb_drawable_t drawable, xcb_gcontext_t gc, int16_t x, int16_t y,
-    uint32_t len, const uint16_t *str)
+// A single text item holds at most 254 glyphs, the value 255 is reserved for
+// the font-shift items.
+#define TEXT_ITEM_MAX 254
+// Keep the requests way below the maximum length the core protocol allows.
+#define TEXT_ITEMS_PER_REQ 64
+#define TEXT_REQ_MAX (TEXT_ITEMS_PER_REQ * TEXT_ITEM_MAX)
+
+// xcb only knows how to compose a PolyText request carrying a single text item,
+// hence we have to do it by ourselves.
+// The funcion was originally taken from 'wmdia' (http://wmdia.sourceforge.net/)
+xcb_void_cookie_t
+xcb_poly_text_simple (xcb_connection_t *c, xcb_drawable_t drawable, xcb_gcontext_t gc,
+        int16_t x, int16_t y, bool wide, uint32_t len, const uint32_t *str)
 {
-    static const xcb_protocol_request_t xcb_req = {
-        5,                // count
-        0,                // ext
-        XCB_POLY_TEXT_16, // opcode
-        1                 // isvoid
+    static uint8_t items[TEXT_ITEMS_PER_REQ * (2 + 2 * TEXT_ITEM_MAX)];
+    const xcb_protocol_request_t xcb_req = {
+        3,                                          // count
+        0,                                          // ext
+        wide ? XCB_POLY_TEXT_16 : XCB_POLY_TEXT_8,  // opcode
+        1                                           // isvoid
     };
-    struct iovec xcb_parts[7];
-    uint8_t xcb_lendelta[2];
+    struct iovec xcb_parts[5];
     xcb_void_cookie_t xcb_ret;
     xcb_poly_text_8_request_t xcb_out;
+    size_t items_len = 0;
+
+    assert(len <= TEXT_REQ_MAX);
+
+    for (uint32_t i = 0; i < len; ) {
+        const uint32_t item_len = min(len - i, TEXT_ITEM_MAX);
+
+        items[items_len++] = item_len;
+        items[items_len++] = 0; // delta
+
+        for (uint32_t j = 0; j < item_len; j++, i++) {
+            // xcb accepts string in UCS-2 BE, so swap
+            if (wide)
+                items[items_len++] = str[i] >> 8;
+            items[items_len++] = str[i] & 0xff;
+        }
+    }
 
     xcb_out.pad0 = 0;
     xcb_out.drawable = drawable;
@@ -144,21 +678,12 @@ xcb_void_cookie_t xcb_poly_text_16_simple(xcb_connection_t * c,
     xcb_out.x = x;
     xcb_out.y = y;
 
-    xcb_lendelta[0] = len;
-    xcb_lendelta[1] = 0;
-
     xcb_parts[2].iov_base = (char *)&xcb_out;
     xcb_parts[2].iov_len = sizeof(xcb_out);
-    xcb_parts[3].iov_base = 0;
-    xcb_parts[3].iov_len = -xcb_parts[2].iov_len & 3;
-
-    xcb_parts[4].iov_base = xcb_lendelta;
-    xcb_parts[4].iov_len = sizeof(xcb_lendelta);
-    xcb_parts[5].iov_base = (char *)str;
-    xcb_parts[5].iov_len = len * sizeof(int16_t);
-
-    xcb_parts[6].iov_base = 0;
-    xcb_parts[6].iov_len = -(xcb_parts[4].iov_len + xcb_parts[5].iov_len) & 3;
+    xcb_parts[3].iov_base = items;
+    xcb_parts[3].iov_len = items_len;
+    xcb_parts[4].iov_base = 0;
+    xcb_parts[4].iov_len = -items_len & 3;
 
     xcb_ret.sequence = xcb_send_request(c, 0, xcb_parts + 2, &xcb_req);
 
@@ -166,67 +691,564 @@ xcb_void_cookie_t xcb_poly_text_16_simple(xcb_connection_t * c,
 }
 
 int
-shift (monitor_t *mon, int x, int align, int ch_width)
-{
-    switch (align) {
-        case ALIGN_C:
-            xcb_copy_area(c, mon->pixmap, mon->pixmap, gc[GC_DRAW],
-                    mon->width / 2 - x / 2, 0,
-                    mon->width / 2 - (x + ch_width) / 2, 0,
-                    x, bh);
-            x = mon->width / 2 - (x + ch_width) / 2 + x;
-            break;
-        case ALIGN_R:
-            xcb_copy_area(c, mon->pixmap, mon->pixmap, gc[GC_DRAW],
-                    mon->width - x, 0,
-                    mon->width - x - ch_width, 0,
-                    x, bh);
-            x = mon->width - ch_width;
+char_width (const font_t *font, const uint32_t ch)
+{
+#if WITH_RENDER
+    // The glyph has been looked up by font_has_glyph already
+    if (font->face)
+        return font->advance[ch >> 8][ch & 0xff];
+#endif
+    const unsigned i = ch - font->char_min;
+
+    switch (font->metrics) {
+        case METRICS_INT8:
+            return font->widths.w8[i];
+        case METRICS_INT16:
+            return font->widths.w16[i];
+        case METRICS_RUNS: {
+            // Find the last run starting before the character
+            unsigned lo = 0, hi = font->run_count;
+
+            while (hi - lo > 1) {
+                const unsigned mid = (lo + hi) / 2;
+
+                if (font->widths.runs[mid].first <= i)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+
+            return font->widths.runs[lo].width;
+        }
+        default:
+            return font->width;
+    }
+}
+
+void
+draw_lines (xcb_drawable_t d, const seg_t *seg, int x, int w)
+{
+    xcb_rectangle_t rects[2];
+    int n = 0;
+
+    if (w <= 0)
+        return;
+
+    /* We can render both at the same time */
+    if (seg->attrs & ATTR_OVERL)
+        rects[n++] = (xcb_rectangle_t){ x, 0, w, bu };
+    if (seg->attrs & ATTR_UNDERL)
+        rects[n++] = (xcb_rectangle_t){ x, bh - bu, w, bu };
+
+    if (n) {
+        xcb_poly_fill_rectangle(c, d, gc_get(seg->ul, NULL), n, rects);
+    }
+}
+
+#if WITH_RENDER
+// Return a solid fill picture of the given color, the pictures can't be
+// modified so the least recently used one is replaced once the pool is full.
+xcb_render_picture_t
+pen_get (const rgba_t color)
+{
+    pen_t *e, *lru = &pen_pool[0];
+
+    for (unsigned i = 0; i < pen_pool_count; i++) {
+        e = &pen_pool[i];
+        if (e->color == color.v) {
+            e->last_use = ++gc_clock;
+            return e->pict;
+        }
+        if (e->last_use < lru->last_use)
+            lru = e;
+    }
+
+    if (pen_pool_count < PEN_POOL_SIZE) {
+        e = &pen_pool[pen_pool_count++];
+    } else {
+        e = lru;
+        xcb_render_free_picture(c, e->pict);
+    }
+
+    // The colors are already premultiplied
+    const xcb_render_color_t rc = {
+        .red = color.r * 0x101,
+        .green = color.g * 0x101,
+        .blue = color.b * 0x101,
+        .alpha = color.a * 0x101,
+    };
+
+    e->pict = xcb_generate_id(c);
+    e->color = color.v;
+    e->last_use = ++gc_clock;
+    xcb_render_create_solid_fill(c, e->pict, rc);
+
+    return e->pict;
+}
+
+// Draw the run by compositing the glyphs that have already been uploaded to
+// the server, each element holds up to 254 glyphs.
+void
+draw_text_render (xcb_drawable_t d, const layout_t *l, const seg_t *seg, int x)
+{
+    const font_t *font = seg->font;
+    const uint32_t *str = l->glyphs + seg->glyph_begin;
+    unsigned left = seg->glyph_len;
+    uint8_t buf[TEXT_REQ_MAX * 4 + TEXT_ITEMS_PER_REQ * 8];
+    xcb_render_picture_t dst;
+
+    dst = xcb_generate_id(c);
+    xcb_render_create_picture(c, dst, d, fmt_visual, 0, NULL);
+
+    while (left) {
+        const unsigned n = min(left, TEXT_REQ_MAX);
+        uint8_t *p = buf;
+
+        for (unsigned i = 0; i < n; i += TEXT_ITEM_MAX) {
+            const unsigned len = min(n - i, TEXT_ITEM_MAX);
+            // Only the first element is positioned, the following ones
+            // continue where the previous one ended
+            const int16_t dx = (i == 0) ? x : 0;
+            const int16_t dy = (i == 0) ? bh / 2 + font->height / 2 - font->descent : 0;
+
+            p[0] = len;
+            p[1] = p[2] = p[3] = 0;
+            memcpy(p + 4, &dx, 2);
+            memcpy(p + 6, &dy, 2);
+            p += 8;
+
+            for (unsigned j = 0; j < len; j++) {
+                const uint32_t id = str[i + j];
+                memcpy(p, &id, 4);
+                p += 4;
+            }
+        }
+
+        xcb_render_composite_glyphs_32(c, XCB_RENDER_PICT_OP_OVER, pen_get(seg->fg), dst,
+                XCB_NONE, font->glyphset, 0, 0, p - buf, buf);
+
+        // The following request starts from scratch
+        for (unsigned i = 0; i < n; i++)
+            x += char_width(font, str[i]);
+
+        str += n;
+        left -= n;
+    }
+
+    xcb_render_free_picture(c, dst);
+}
+#endif
+
+void
+draw_text (xcb_drawable_t d, const layout_t *l, const seg_t *seg, int x)
+{
+    const font_t *font = seg->font;
+    const uint32_t *str = l->glyphs + seg->glyph_begin;
+    unsigned left = seg->glyph_len;
+
+#if WITH_RENDER
+    if (font->face) {
+        draw_text_render(d, l, seg, x);
+        return;
+    }
+#endif
+
+    const xcb_gcontext_t gc = gc_get(seg->fg, font);
+
+    while (left) {
+        const unsigned n = min(left, TEXT_REQ_MAX);
+
+        // The coordinates here are those of the baseline
+        xcb_poly_text_simple(c, d, gc,
+                x, bh / 2 + font->height / 2 - font->descent,
+                seg->wide, n, str);
+
+        for (unsigned i = 0; i < n; i++)
+            x += char_width(font, str[i]);
+
+        str += n;
+        left -= n;
+    }
+}
+
+void
+draw_seg_at (xcb_drawable_t d, const layout_t *l, const seg_t *seg, int x)
+{
+    const int w = seg->right - seg->left;
+
+    if (seg->type != SEG_LINES) {
+        // Draw the background first
+        fill_rect(d, gc_get(seg->bg, NULL), x, 0, w, bh);
+    }
+    if (seg->type == SEG_TEXT)
+        draw_text(d, l, seg, x);
+    draw_lines(d, seg, x, w);
+}
+
+void
+cache_unlink (cache_entry_t *e)
+{
+    cache_entry_t **p = &cache.buckets[e->key & (CACHE_BUCKETS - 1)];
+
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+
+    if (e->prev) e->prev->next = e->next;
+    else cache.head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else cache.tail = e->prev;
+
+    if (e->pixmap != XCB_NONE) {
+        xcb_free_pixmap(c, e->pixmap);
+        cache.size -= e->width * bh * 4;
+    }
+
+    cache.entries -= 1;
+    free(e);
+}
+
+void
+cache_push_front (cache_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = cache.head;
+    if (cache.head) cache.head->prev = e;
+    cache.head = e;
+    if (!cache.tail) cache.tail = e;
+}
+
+// Look up the pixmap holding the pre-rendered segment. The first time a
+// segment is seen only its key is remembered, segments that change on every
+// frame would otherwise keep on thrashing the cache.
+xcb_pixmap_t
+cache_get (const layout_t *l, const seg_t *seg)
+{
+    const int w = seg->right - seg->left;
+    const size_t size = w * bh * 4;
+    cache_entry_t *e;
+
+    for (e = cache.buckets[seg->hash & (CACHE_BUCKETS - 1)]; e; e = e->hnext) {
+        if (e->key == seg->hash && e->width == w)
             break;
     }
 
-    // Draw the background first
-    fill_rect(mon->pixmap, gc[GC_CLEAR], x, 0, ch_width, bh);
-    return x;
+    if (e && e->pixmap != XCB_NONE) {
+        cache.hits += 1;
+        // Move it to the front of the LRU list
+        if (e != cache.head) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev;
+            else cache.tail = e->prev;
+            cache_push_front(e);
+        }
+        return e->pixmap;
+    }
+
+    cache.misses += 1;
+
+    // Don't let a single segment take over the whole cache
+    if (size > cache.limit / 4)
+        return XCB_NONE;
+
+    if (!e) {
+        while (cache.entries >= CACHE_ENTRIES_MAX)
+            cache_unlink(cache.tail);
+
+        e = xcalloc(1, sizeof(cache_entry_t));
+        e->key = seg->hash;
+        e->width = w;
+        e->pixmap = XCB_NONE;
+        e->hnext = cache.buckets[e->key & (CACHE_BUCKETS - 1)];
+        cache.buckets[e->key & (CACHE_BUCKETS - 1)] = e;
+        cache.entries += 1;
+        cache_push_front(e);
+        return XCB_NONE;
+    }
+
+    // Seen before, it's worth rendering it off-screen.
+    while (cache.size + size > cache.limit && cache.tail != e)
+        cache_unlink(cache.tail);
+
+    e->pixmap = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, e->pixmap, scr->root, w, bh);
+    cache.size += size;
+
+    draw_seg_at(e->pixmap, l, seg, 0);
+
+    return e->pixmap;
 }
 
 void
-draw_lines (monitor_t *mon, int x, int w)
+draw_seg (const layout_t *l, const seg_t *seg)
 {
-    /* We can render both at the same time */
-    if (attrs & ATTR_OVERL)
-        fill_rect(mon->pixmap, gc[GC_ATTR], x, 0, w, bu);
-    if (attrs & ATTR_UNDERL)
-        fill_rect(mon->pixmap, gc[GC_ATTR], x, bh - bu, w, bu);
+    monitor_t *mon = l->blocks[seg->block].mon;
+
+    if (seg->type == SEG_TEXT && cache.limit) {
+        xcb_pixmap_t pixmap = cache_get(l, seg);
+
+        if (pixmap != XCB_NONE) {
+            xcb_copy_area(c, pixmap, mon->pixmap, gc_copy,
+                    0, 0, seg->left, 0, seg->right - seg->left, bh);
+            return;
+        }
+    }
+
+    draw_seg_at(mon->pixmap, l, seg, seg->left);
+}
+
+glyph_t *
+glyph_get (font_t *font, const uint32_t ch)
+{
+    if (!font->bitmaps)
+        font->bitmaps = xcalloc(GLYPH_PAGES, sizeof(glyph_t *));
+
+    glyph_t *page = font->bitmaps[ch >> 8];
+
+    if (!page) {
+        page = xcalloc(256, sizeof(glyph_t));
+        font->bitmaps[ch >> 8] = page;
+    }
+
+    return &page[ch & 0xff];
+}
+
+// Rounded a * b / 255
+static inline uint8_t
+mul8 (const unsigned a, const unsigned b)
+{
+    const unsigned t = a * b + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+void
+image_fill (monitor_t *mon, int x, int y, int w, int h, const rgba_t color)
+{
+    // Clip the rectangle to the image
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    w = min(w, mon->width - x);
+    h = min(h, bh - y);
+
+    for (int j = 0; j < h; j++) {
+        uint32_t *row = mon->image + (y + j) * mon->width + x;
+
+        for (int i = 0; i < w; i++)
+            row[i] = color.v;
+    }
+}
+
+// Blend the glyph coverage mask in, the colors are premultiplied so the
+// source is scaled by the coverage and composited over the destination.
+void
+image_blit_glyph (monitor_t *mon, const glyph_t *g, const int x, const int y, const rgba_t color)
+{
+    const int x0 = max(x, 0), x1 = min(x + g->width, mon->width);
+    const int y0 = max(y, 0), y1 = min(y + g->height, bh);
+
+    for (int j = y0; j < y1; j++) {
+        const uint8_t *mask = g->data + (j - y) * g->width;
+        uint32_t *row = mon->image + j * mon->width;
+
+        for (int i = x0; i < x1; i++) {
+            const uint8_t cov = mask[i - x];
+
+            if (cov == 0)
+                continue;
+
+            if (cov == 0xff && color.a == 0xff) {
+                row[i] = color.v;
+                continue;
+            }
+
+            const uint8_t a = mul8(color.a, cov);
+            rgba_t d = (rgba_t)row[i];
+
+            d.r = mul8(color.r, cov) + mul8(d.r, 255 - a);
+            d.g = mul8(color.g, cov) + mul8(d.g, 255 - a);
+            d.b = mul8(color.b, cov) + mul8(d.b, 255 - a);
+            d.a = a + mul8(d.a, 255 - a);
+            row[i] = d.v;
+        }
+    }
 }
 
 void
-draw_shift (monitor_t *mon, int x, int align, int w)
+image_draw_seg (monitor_t *mon, const layout_t *l, const seg_t *seg)
 {
-    x = shift(mon, x, align, w);
-    draw_lines(mon, x, w);
+    const int x = seg->left, w = seg->right - seg->left;
+
+    if (seg->type != SEG_LINES)
+        image_fill(mon, x, 0, w, bh, seg->bg);
+
+    if (seg->type == SEG_TEXT) {
+        const font_t *font = seg->font;
+        const uint32_t *str = l->glyphs + seg->glyph_begin;
+        const int baseline = bh / 2 + font->height / 2 - font->descent;
+        int pen = x;
+
+        // The glyphs have been loaded by the main thread already, don't use
+        // glyph_get here as this may run on a worker thread.
+        for (unsigned i = 0; i < seg->glyph_len; i++) {
+            const glyph_t *page = font->bitmaps ? font->bitmaps[str[i] >> 8] : NULL;
+            const glyph_t *g = page ? &page[str[i] & 0xff] : NULL;
+
+            if (g && g->data)
+                image_blit_glyph(mon, g, pen + g->x, baseline - g->y, seg->fg);
+            pen += char_width(font, str[i]);
+        }
+    }
+
+    if (seg->attrs & ATTR_OVERL)
+        image_fill(mon, x, 0, w, bu, seg->ul);
+    if (seg->attrs & ATTR_UNDERL)
+        image_fill(mon, x, bh - bu, w, bu, seg->ul);
 }
 
-int
-draw_char (monitor_t *mon, font_t *cur_font, int x, int align, uint16_t ch)
+// Upload a vertical stripe of the image with plain PutImage requests, the
+// rows are spread over as many requests as needed to fit the maximum request
+// length.
+void
+image_put (monitor_t *mon, const int x, const int w)
+{
+    const size_t max_len = xcb_get_maximum_request_length(c) * 4 - sizeof(xcb_put_image_request_t);
+    const int rows = max(1, min(bh, (int)(max_len / (w * 4))));
+    uint32_t *buf = xmalloc(w * rows * 4);
+
+    for (int y = 0; y < bh; y += rows) {
+        const int n = min(rows, bh - y);
+
+        for (int j = 0; j < n; j++)
+            memcpy(buf + j * w, mon->image + (y + j) * mon->width + x, w * 4);
+
+        xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, mon->pixmap, gc_copy,
+                w, n, x, y, 0, depth, w * n * 4, (const uint8_t *)buf);
+    }
+
+    free(buf);
+}
+
+// Push the dirty parts of the image to the pixmap
+void
+image_push (monitor_t *mon)
+{
+    for (unsigned i = 0; i < mon->dirty_count; i++) {
+        const int x = mon->dirty[i].begin, w = mon->dirty[i].end - x;
+
+#if WITH_SHM
+        if (shm_ok) {
+            xcb_shm_put_image(c, mon->pixmap, gc_copy, mon->width, bh, x, 0, w, bh, x, 0,
+                    depth, XCB_IMAGE_FORMAT_Z_PIXMAP, false, mon->shmseg, 0);
+            shm_busy = true;
+            continue;
+        }
+#endif
+        image_put(mon, x, w);
+    }
+}
+
+void
+image_create (monitor_t *mon)
+{
+    const size_t size = mon->width * bh * sizeof(uint32_t);
+
+#if WITH_SHM
+    if (shm_ok) {
+        const int id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+        void *addr = (id != -1) ? shmat(id, NULL, 0) : (void *)-1;
+        xcb_generic_error_t *err = NULL;
+
+        if (addr != (void *)-1) {
+            mon->shmseg = xcb_generate_id(c);
+            err = xcb_request_check(c, xcb_shm_attach_checked(c, mon->shmseg, id, false));
+        }
+
+        // The segment is destroyed once both sides have detached it
+        if (id != -1)
+            shmctl(id, IPC_RMID, NULL);
+
+        if (addr != (void *)-1 && !err) {
+            mon->image = addr;
+            memset(mon->image, 0, size);
+            return;
+        }
+
+        free(err);
+        if (addr != (void *)-1)
+            shmdt(addr);
+        mon->shmseg = XCB_NONE;
+
+        fprintf(stderr, "Couldn't share the memory with the server, falling back to PutImage\n");
+        shm_ok = false;
+    }
+#endif
+
+    mon->image = xcalloc(size, 1);
+}
+
+void
+image_destroy (monitor_t *mon)
+{
+#if WITH_SHM
+    if (mon->shmseg) {
+        xcb_shm_detach(c, mon->shmseg);
+        shmdt(mon->image);
+        mon->image = NULL;
+        mon->shmseg = XCB_NONE;
+        return;
+    }
+#endif
+    free(mon->image);
+    mon->image = NULL;
+}
+
+// The client side drawing needs the pixels of the pixmaps to be laid out as
+// the rgba_t are in memory.
+bool
+image_check (void)
 {
-    int ch_width = (cur_font->width_lut) ?
-        cur_font->width_lut[ch - cur_font->char_min].character_width:
-        cur_font->width;
+    const xcb_setup_t *setup = xcb_get_setup(c);
+    const uint16_t probe = 1;
+    bool ok = false;
 
-    x = shift(mon, x, align, ch_width);
+    if ((setup->image_byte_order == XCB_IMAGE_ORDER_LSB_FIRST) != (*(const uint8_t *)&probe == 1))
+        return false;
+
+    xcb_format_iterator_t iter = xcb_setup_pixmap_formats_iterator(setup);
+    for (; iter.rem; xcb_format_next(&iter)) {
+        if (iter.data->depth == depth)
+            ok = iter.data->bits_per_pixel == 32 && iter.data->scanline_pad == 32;
+    }
 
-    // xcb accepts string in UCS-2 BE, so swap
-    ch = (ch >> 8) | (ch << 8);
+#if WITH_SHM
+    const xcb_query_extension_reply_t *qe_reply = xcb_get_extension_data(c, &xcb_shm_id);
+    shm_ok = ok && qe_reply && qe_reply->present;
+#endif
 
-    // The coordinates here are those of the baseline
-    xcb_poly_text_16_simple(c, mon->pixmap, gc[GC_DRAW],
-                            x, bh / 2 + cur_font->height / 2 - cur_font->descent,
-                            1, &ch);
+    return ok;
+}
 
-    draw_lines(mon, x, ch_width);
+// Premultiply the alpha in
+rgba_t
+color_premultiply (const rgba_t c)
+{
+    if (c.a) {
+        // The components are clamped automagically as the rgba_t is made of uint8_t
+        return (rgba_t){
+            .r = (c.r * c.a) / 255,
+            .g = (c.g * c.a) / 255,
+            .b = (c.b * c.a) / 255,
+            .a = c.a,
+        };
+    }
 
-    return ch_width;
+    return (rgba_t)0U;
 }
 
 rgba_t
@@ -246,6 +1268,21 @@ parse_color (const char *str, char **end, const rgba_t def)
         return def;
     }
 
+    // Palette index
+    if (isdigit(str[0])) {
+        unsigned long idx = strtoul(str, &ep, 10);
+
+        if (end)
+            *end = ep;
+
+        if (idx >= palette_count) {
+            fprintf(stderr, "Invalid palette index %lu\n", idx);
+            return def;
+        }
+
+        return palette[idx];
+    }
+
     // Hex representation
     if (str[0] != '#') {
         if (end)
@@ -288,18 +1325,7 @@ parse_color (const char *str, char **end, const rgba_t def)
             return def;
     }
 
-    // Premultiply the alpha in
-    if (tmp.a) {
-        // The components are clamped automagically as the rgba_t is made of uint8_t
-        return (rgba_t){
-            .r = (tmp.r * tmp.a) / 255,
-            .g = (tmp.g * tmp.a) / 255,
-            .b = (tmp.b * tmp.a) / 255,
-            .a = tmp.a,
-        };
-    }
-
-    return (rgba_t)0U;
+    return color_premultiply(tmp);
 }
 
 void
@@ -329,78 +1355,74 @@ area_get (xcb_window_t win, const int btn, const int x)
     // Looping backwards ensures that we get the innermost area first
     for (int i = area_stack.index - 1; i >= 0; i--) {
         area_t *a = &area_stack.ptr[i];
-        if (a->window == win && a->button == btn && x >= a->begin && x < a->end)
-            return a;
-    }
-    return NULL;
-}
 
-void
-area_shift (xcb_window_t win, const int align, int delta)
-{
-    if (align == ALIGN_L)
-        return;
-    if (align == ALIGN_C)
-        delta /= 2;
+        // Areas left open are never clickable
+        if (!a->complete || a->window != win || a->button != btn)
+            continue;
 
-    for (int i = 0; i < area_stack.index; i++) {
-        area_t *a = &area_stack.ptr[i];
-        if (a->window == win && a->align == align && !a->complete) {
-            a->begin -= delta;
-            a->end -= delta;
-        }
+        // The area position is relative to the blocks on screen
+        const int begin = prev_lay->blocks[a->block_begin].origin + a->begin;
+        const int end = prev_lay->blocks[a->block_end].origin + a->end;
+        if (x >= begin && x < end)
+            return a;
     }
+    return NULL;
 }
 
-bool
-area_add (char *str, const char *optend, char **end, monitor_t *mon, const int x, const int align, const int button)
+// Close the most recent area left open
+area_t *
+area_close (const unsigned block, const int x)
 {
     int i;
-    char *trail;
-    area_t *a;
-
-    // A wild close area tag appeared!
-    if (*str != ':') {
-        *end = str;
+    const block_t *blk = &lay->blocks[block];
 
-        // Find most recent unclosed area.
-        for (i = area_stack.index - 1; i >= 0 && !area_stack.ptr[i].complete; i--)
-            ;
-        a = &area_stack.ptr[i];
+    // Find most recent unclosed area.
+    for (i = area_stack.index - 1; i >= 0 && area_stack.ptr[i].complete; i--)
+        ;
 
-        // Basic safety checks
-        if (!a->cmd || a->align != align || a->window != mon->window) {
-            fprintf(stderr, "Invalid geometry for the clickable area\n");
-            return false;
-        }
+    // Basic safety checks
+    if (i < 0 || area_stack.ptr[i].align != blk->align ||
+            area_stack.ptr[i].window != blk->mon->window) {
+        fprintf(stderr, "Invalid geometry for the clickable area\n");
+        return NULL;
+    }
 
-        const int size = x - a->begin;
+    // The position is resolved once the block is laid out
+    area_t *a = &area_stack.ptr[i];
+    a->end = x;
+    a->block_end = block;
+    a->complete = true;
 
-        switch (align) {
-            case ALIGN_L:
-                a->end = x;
-                break;
-            case ALIGN_C:
-                a->begin = mon->width / 2 - size / 2 + a->begin / 2;
-                a->end = a->begin + size;
-                break;
-            case ALIGN_R:
-                // The newest is the rightmost one
-                a->begin = mon->width - size;
-                a->end = mon->width;
-                break;
-        }
+    return a;
+}
 
-        a->complete = false;
-        return true;
-    }
+void
+area_open (char *cmd, const unsigned block, const int x, const int button)
+{
+    const block_t *blk = &lay->blocks[block];
 
     if (area_stack.index + 1 > area_stack.alloc) {
         area_stack.ptr = xreallocarray(area_stack.ptr, area_stack.index + 1,
                 sizeof(area_t));
         area_stack.alloc += 1;
     }
-    a = &area_stack.ptr[area_stack.index++];
+
+    area_t *a = &area_stack.ptr[area_stack.index++];
+    a->cmd = cmd;
+    a->complete = false;
+    a->align = blk->align;
+    a->begin = x;
+    a->block_begin = block;
+    a->window = blk->mon->window;
+    a->button = button;
+}
+
+// Extract the command following the : at str, it's terminated and unescaped in
+// place. Returns NULL if it's empty or not terminated within the block
+char *
+area_cmd (char *str, const char *optend, char **end)
+{
+    char *trail;
 
     // Found the closing : and check if it's just an escaped one
     for (trail = strchr(++str, ':'); trail && trail[-1] == '\\'; trail = strchr(trail + 1, ':'))
@@ -409,7 +1431,7 @@ area_add (char *str, const char *optend, char **end, monitor_t *mon, const int x
     // Find the trailing : and make sure it's within the formatting block, also reject empty commands
     if (!trail || str == trail || trail > optend) {
         *end = str;
-        return false;
+        return NULL;
     }
 
     *trail = '\0';
@@ -423,997 +1445,4588 @@ area_add (char *str, const char *optend, char **end, monitor_t *mon, const int x
         }
     }
 
-    // This is a pointer to the string buffer allocated in the main
-    a->cmd = str;
-    a->complete = true;
-    a->align = align;
-    a->begin = x;
-    a->window = mon->window;
-    a->button = button;
-
     *end = trail + 1;
 
-    return true;
+    return str;
 }
 
 bool
-font_has_glyph (font_t *font, const uint16_t c)
+area_add (char *str, const char *optend, char **end, const unsigned block, const int x, const int button)
 {
-    if (c < font->char_min || c > font->char_max)
-        return false;
+    // A wild close area tag appeared!
+    if (*str != ':') {
+        *end = str;
+
+        area_t *a = area_close(block, x);
+        if (!a)
+            return false;
+        a->closed_at = str - line_buf;
+        return true;
+    }
 
-    if (font->width_lut && font->width_lut[c - font->char_min].character_width == 0)
+    // This is a pointer to the string buffer allocated in the main
+    char *cmd = area_cmd(str, optend, end);
+    if (!cmd)
         return false;
 
+    area_open(cmd, block, x, button);
+
     return true;
 }
 
-// returns NULL if character cannot be printed
-font_t *
-select_drawable_font (const uint16_t c)
+// Keep only the character widths out of the font infos, in the most compact
+// form among a single width, runs of characters having the same width and a
+// dense array of 8 or 16 bit widths.
+void
+font_metrics_build (font_t *font, const xcb_query_font_reply_t *info)
 {
-    // If the user has specified a font to use, try that first.
-    if (font_index != -1 && font_has_glyph(font_list[font_index - 1], c))
-        return font_list[font_index - 1];
+    const xcb_charinfo_t *ci = xcb_query_font_char_infos(info);
+    const int ci_len = xcb_query_font_char_infos_length(info);
+    const unsigned cols = info->max_char_or_byte2 - info->min_char_or_byte2 + 1;
+    const unsigned n = font->char_max - font->char_min + 1;
 
-    // If the end is reached without finding an appropriate font, return NULL.
-    // If the font can draw the character, return it.
-    for (int i = 0; i < font_count; i++) {
-        if (font_has_glyph(font_list[i], c))
-            return font_list[i];
+    font->metrics = METRICS_CONSTANT;
+
+    // All the characters in the range have the maximum width
+    if (!ci_len)
+        return;
+
+    // The infos are laid out as a matrix indexed by the two bytes of the
+    // character, unfold it first
+    int16_t *w = xcalloc(n, sizeof(int16_t));
+
+    for (unsigned b1 = info->min_byte1; b1 <= info->max_byte1; b1++) {
+        for (unsigned b2 = info->min_char_or_byte2; b2 <= info->max_char_or_byte2; b2++) {
+            const unsigned idx = (b1 - info->min_byte1) * cols + (b2 - info->min_char_or_byte2);
+
+            if (idx < (unsigned)ci_len)
+                w[(b1 << 8 | b2) - font->char_min] = ci[idx].character_width;
+        }
+    }
+
+    bool constant = true, holes = false, fits8 = true;
+    unsigned runs = 0;
+    int common = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        if (w[i] == 0)
+            holes = true;
+        else if (!common)
+            common = w[i];
+        else if (w[i] != common)
+            constant = false;
+
+        if (w[i] < INT8_MIN || w[i] > INT8_MAX)
+            fits8 = false;
+        if (i == 0 || w[i] != w[i - 1])
+            runs++;
+    }
+
+    if (constant) {
+        font->width = common;
+
+        if (holes) {
+            font->present = xcalloc((n + 7) / 8, 1);
+            for (unsigned i = 0; i < n; i++) {
+                if (w[i])
+                    font->present[i >> 3] |= 1 << (i & 7);
+            }
+        }
+
+        free(w);
+        return;
+    }
+
+    const size_t size_runs = runs * sizeof(width_run_t);
+    const size_t size8 = fits8 ? n : SIZE_MAX;
+    const size_t size16 = n * sizeof(int16_t);
+
+    if (size_runs <= size8 && size_runs <= size16) {
+        font->metrics = METRICS_RUNS;
+        font->widths.runs = xmalloc(size_runs);
+        font->run_count = 0;
+        for (unsigned i = 0; i < n; i++) {
+            if (i == 0 || w[i] != w[i - 1])
+                font->widths.runs[font->run_count++] = (width_run_t){ i, w[i] };
+        }
+        free(w);
+    } else if (size8 <= size16) {
+        font->metrics = METRICS_INT8;
+        font->widths.w8 = xmalloc(n);
+        for (unsigned i = 0; i < n; i++)
+            font->widths.w8[i] = w[i];
+        free(w);
+    } else {
+        font->metrics = METRICS_INT16;
+        font->widths.w16 = w;
     }
-    return NULL;
 }
 
-int
-pos_to_absolute(monitor_t *mon, int pos, int align)
+// The same font name may resolve to different fonts on different servers, the
+// server font path is thus part of the key.
+char *
+font_cache_key (const font_t *font, size_t *len)
 {
-    switch (align) {
-        case ALIGN_L: return pos;
-        case ALIGN_R: return mon->width - pos;
-        case ALIGN_C: return mon->width / 2 + pos / 2;
-    }
+    const size_t name_len = strlen(font->pattern) + 1;
+    const size_t path_len = strlen(font_path);
+    char *key = xmalloc(name_len + path_len);
 
-    return 0;
+    memcpy(key, font->pattern, name_len);
+    memcpy(key + name_len, font_path, path_len);
+    *len = name_len + path_len;
+
+    return key;
 }
 
-void
-parse (char *text)
+// The files live in $XDG_CACHE_HOME/lemonbar and are named after a hash of the
+// key, the key itself is stored in the file to catch the collisions. The cache
+// is private to the user: the sessions of the same user share it, the other
+// users don't, as a world-writable directory would let anyone feed the bar
+// with forged metrics.
+char *
+font_cache_path (const char *key, size_t len)
 {
-    font_t *cur_font;
-    monitor_t *cur_mon;
-    int pos_x, align, button;
-    char *p = text, *block_end, *ep;
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX], *path;
+
+    if (base && *base)
+        snprintf(dir, sizeof(dir), "%s", base);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return NULL;
+
+    if (asprintf(&path, "%s/lemonbar/font-%016llx", dir,
+                (unsigned long long)fnv1a(key, len, FNV1A_INIT)) < 0)
+        return NULL;
+
+    return path;
+}
 
-    pos_x = 0;
-    align = ALIGN_L;
-    cur_mon = monhead;
+size_t
+font_cache_widths_len (const font_t *font)
+{
+    const size_t n = font->char_max - font->char_min + 1;
+
+    switch (font->metrics) {
+        case METRICS_RUNS:
+            return font->run_count * sizeof(width_run_t);
+        case METRICS_INT8:
+            return n;
+        case METRICS_INT16:
+            return n * sizeof(int16_t);
+        default:
+            return 0;
+    }
+}
 
-    // Reset the default color set
-    bgc = dbgc;
-    fgc = dfgc;
-    ugc = dugc;
-    update_gc();
-    // Reset the default attributes
-    attrs = 0;
+// Map the cached metrics of the font, the width tables are used in place and
+// are thus shared with any other instance through the page cache.
+bool
+font_cache_load (font_t *font)
+{
+    struct stat st;
+    size_t key_len;
+    char *key, *path;
+    void *map;
+    int fd;
 
-    // Reset the stack position
-    area_stack.index = 0;
+    if (!font_path)
+        return false;
 
-    for (monitor_t *m = monhead; m != NULL; m = m->next)
-        fill_rect(m->pixmap, gc[GC_CLEAR], 0, 0, m->width, bh);
+    key = font_cache_key(font, &key_len);
+    path = font_cache_path(key, key_len);
+    fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
 
-    for (;;) {
-        if (*p == '\0' || *p == '\n')
-            return;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(font_cache_t)) {
+        if (fd >= 0)
+            close(fd);
+        free(key);
+        return false;
+    }
 
-        if (p[0] == '%' && p[1] == '{' && (block_end = strchr(p++, '}'))) {
-            p++;
-            while (p < block_end) {
-                while (isspace(*p))
-                    p++;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
 
-                switch (*p++) {
-                    // Enable/disable attributes.
-                    case '+': set_attribute('+', *p++); break;
-                    case '-': set_attribute('-', *p++); break;
-                    case '!': set_attribute('!', *p++); break;
+    if (map == MAP_FAILED) {
+        free(key);
+        return false;
+    }
 
-                    // Reverse foreground/background color.
-                    case 'R': {
-                        rgba_t tmp = fgc;
-                        fgc = bgc;
-                        bgc = tmp;
-                        update_gc();
-                    } break;
+    const font_cache_t *hdr = map;
+    const size_t key_off = ALIGN8(sizeof(font_cache_t));
+    const size_t widths_off = ALIGN8(key_off + key_len);
+    const size_t present_off = ALIGN8(widths_off + hdr->widths_len);
+    const size_t n = hdr->char_max - hdr->char_min + 1;
+
+    // Make sure the file was written by this version and for this font, and
+    // that the tables are where they're expected to be
+    bool valid = hdr->magic == FONT_CACHE_MAGIC &&
+        hdr->version == FONT_CACHE_VERSION &&
+        hdr->size == (size_t)st.st_size &&
+        hdr->key_len == key_len &&
+        hdr->char_min <= hdr->char_max &&
+        hdr->metrics <= METRICS_INT16 &&
+        present_off + hdr->present_len == hdr->size &&
+        (hdr->present_len == 0 || hdr->present_len == (n + 7) / 8) &&
+        !memcmp((const char *)map + key_off, key, key_len);
+
+    free(key);
+
+    if (valid) {
+        font->metrics = hdr->metrics;
+        font->char_min = hdr->char_min;
+        font->char_max = hdr->char_max;
+        font->run_count = hdr->run_count;
+        valid = font_cache_widths_len(font) == hdr->widths_len;
+    }
 
-                    // Alignment specifiers.
-                    // Keep track of where we are and where we're moving to so
-                    // that underlines/overlines are correctly drawn over the
-                    // empty space.
-                    case 'l': {
-                        int left_ep = 0;
-                        int right_ep = pos_to_absolute(cur_mon, pos_x, align);
-                        draw_lines(cur_mon, left_ep, right_ep - left_ep);
-                        pos_x = 0; align = ALIGN_L;
-                    } break;
-                    case 'c': {
-                        int left_ep = pos_to_absolute(cur_mon, pos_x, align);
-                        int right_ep = cur_mon->width / 2;
-                        if (right_ep < left_ep) {
-                            int tmp = left_ep;
-                            left_ep = right_ep;
-                            right_ep = tmp;
-                        }
-                        draw_lines(cur_mon, left_ep, right_ep - left_ep);
-                        pos_x = 0; align = ALIGN_C;
-                    } break;
-                    case 'r': {
-                        int left_ep = pos_to_absolute(cur_mon, pos_x, align);
-                        int right_ep = cur_mon->width;
-                        if (right_ep < left_ep) {
-                            int tmp = left_ep;
-                            left_ep = right_ep;
-                            right_ep = tmp;
-                        }
-                        draw_lines(cur_mon, left_ep, right_ep - left_ep);
-                        pos_x = 0; align = ALIGN_R;
-                    } break;
+    if (!valid) {
+        munmap(map, st.st_size);
+        font->metrics = METRICS_CONSTANT;
+        return false;
+    }
 
-                    // Define input area.
-                    case 'A': {
-                        button = XCB_BUTTON_INDEX_1;
-                        // The range is 1-5
-                        if (isdigit(*p) && (*p > '0' && *p < '6'))
-                            button = *p++ - '0';
-                        if (!area_add(p, block_end, &p, cur_mon, pos_x, align, button))
-                            return;
-                    } break;
+    font->descent = hdr->descent;
+    font->ascent = hdr->ascent;
+    if (!font->height)
+        font->height = hdr->ascent + hdr->descent;
+    font->lbearing = hdr->lbearing;
+    font->rbearing = hdr->rbearing;
+    font->width = hdr->width;
+    font->widths.w8 = hdr->widths_len ? (int8_t *)map + widths_off : NULL;
+    font->present = hdr->present_len ? (uint8_t *)map + present_off : NULL;
+    font->cache = map;
+    font->cache_size = st.st_size;
 
-                    // Set background/foreground/underline color.
-                    case 'B': bgc = parse_color(p, &p, dbgc); update_gc(); break;
-                    case 'F': fgc = parse_color(p, &p, dfgc); update_gc(); break;
-                    case 'U': ugc = parse_color(p, &p, dugc); update_gc(); break;
+    return true;
+}
 
-                    // Set current monitor used for drawing.
-                    case 'S': {
-                        monitor_t *orig_mon = cur_mon;
+// Write the metrics to a temporary file first and then move it in place, the
+// other instances either see the whole file or none at all.
+void
+font_cache_store (const font_t *font)
+{
+    size_t key_len;
+    char *key, *path, *tmp;
+    int fd;
 
-                        switch (*p) {
-                            case '+': // Next monitor.
-                                if (cur_mon->next) cur_mon = cur_mon->next;
-                                p += 1;
-                                break;
-                            case '-': // Previous monitor.
-                                if (cur_mon->prev) cur_mon = cur_mon->prev;
-                                p += 1;
-                                break;
-                            case 'f': // First monitor.
-                                cur_mon = monhead;
-                                p += 1;
-                                break;
-                            case 'l': // Last monitor.
-                                cur_mon = montail ? montail : monhead;
-                                p += 1;
-                                break;
-                            case 'n': { // Named monitor.
-                                const size_t name_len = block_end - (p + 1);
-                                cur_mon = monhead;
-                                while (cur_mon) {
-                                    if (cur_mon->name &&
-                                            !strncmp(cur_mon->name, p + 1, name_len) &&
-                                            cur_mon->name[name_len] == '\0')
-                                        break;
-                                    cur_mon = cur_mon->next;
-                                }
-                                if (!cur_mon) cur_mon = orig_mon;
-                                p += 1 + name_len;
-                            } break;
-                            case '0' ... '9': // Numbered monitor.
-                                cur_mon = monhead;
-                                for (int i = 0; i != *p-'0' && cur_mon->next; i++)
-                                    cur_mon = cur_mon->next;
-                                p += 1;
-                                break;
-                            default:
-                                fprintf(stderr, "Unknown S specifier '%c'\n", *p++);
-                                break;
-                        }
+    if (!font_path)
+        return;
 
-                        if (orig_mon != cur_mon) {
-                            pos_x = 0;
-                            align = ALIGN_L;
-                        }
-                    } break;
+    key = font_cache_key(font, &key_len);
+    path = font_cache_path(key, key_len);
 
-                    // Draw a N-pixel wide empty character.
-                    case 'O': {
-                        errno = 0;
-                        int w = (int) strtoul(p, &p, 10);
-                        if (errno)
-                            continue;
+    if (!path) {
+        free(key);
+        return;
+    }
 
-                        draw_shift(cur_mon, pos_x, align, w);
+    // Create the lemonbar directory and its parent if needed
+    char *sep = strrchr(path, '/');
+    *sep = '\0';
+    char *parent = strrchr(path, '/');
+    *parent = '\0';
+    mkdir(path, 0700);
+    *parent = '/';
+    mkdir(path, 0700);
+    *sep = '/';
+
+    const size_t n = font->char_max - font->char_min + 1;
+    const size_t widths_len = font_cache_widths_len(font);
+    const size_t present_len = font->present ? (n + 7) / 8 : 0;
+    const size_t key_off = ALIGN8(sizeof(font_cache_t));
+    const size_t widths_off = ALIGN8(key_off + key_len);
+    const size_t present_off = ALIGN8(widths_off + widths_len);
+    const size_t size = present_off + present_len;
+
+    char *buf = xcalloc(1, size);
+    *(font_cache_t *)buf = (font_cache_t) {
+        .magic = FONT_CACHE_MAGIC,
+        .version = FONT_CACHE_VERSION,
+        .size = size,
+        .key_len = key_len,
+        .ascent = font->ascent,
+        .descent = font->descent,
+        .lbearing = font->lbearing,
+        .rbearing = font->rbearing,
+        .width = font->width,
+        .char_min = font->char_min,
+        .char_max = font->char_max,
+        .metrics = font->metrics,
+        .run_count = font->run_count,
+        .widths_len = widths_len,
+        .present_len = present_len,
+    };
+    memcpy(buf + key_off, key, key_len);
+    if (widths_len)
+        memcpy(buf + widths_off, font->widths.w8, widths_len);
+    if (present_len)
+        memcpy(buf + present_off, font->present, present_len);
+
+    const bool have_tmp = asprintf(&tmp, "%s.XXXXXX", path) >= 0;
+    fd = have_tmp ? mkstemp(tmp) : -1;
+
+    if (fd >= 0) {
+        bool ok = write(fd, buf, size) == (ssize_t)size;
+        ok = !close(fd) && ok;
+        if (!ok || rename(tmp, path) < 0)
+            unlink(tmp);
+    }
 
-                        pos_x += w;
-                        area_shift(cur_mon->window, align, w);
-                    } break;
+    // The contents of tmp are undefined if asprintf failed
+    if (have_tmp)
+        free(tmp);
+    free(buf);
+    free(path);
+    free(key);
+}
 
-                    case 'T': {
-                          if (*p == '-') {
-                              // Switch to automatic font selection.
-                              font_index = -1;
-                              p++;
-                          } else if (isdigit(*p)) {
-                              font_index = (int)strtoul(p, &ep, 10);
-                              // User-specified 'font_index' ∊ (0,font_count]
-                              // Otherwise just fallback to the automatic font selection
-                              if (!font_index || font_index > font_count) {
-                                  fprintf(stderr, "Invalid font index %d\n", font_index);
-                                  font_index = -1;
-                              }
-                              p = ep;
-                          } else {
-                              // Swallow the invalid character and keep parsing.
-                              fprintf(stderr, "Invalid font slot \"%c\"\n", *p++);
-                          }
-                    } break;
+// Drop the width tables, be them mapped from the cache or not.
+void
+font_metrics_free (font_t *font)
+{
+    if (font->cache) {
+        munmap(font->cache, font->cache_size);
+        font->cache = NULL;
+    } else {
+        if (font->metrics != METRICS_CONSTANT)
+            free(font->widths.w8);
+        free(font->present);
+    }
 
-                    // In case of error keep parsing after the closing }
-                    default:
-                        p = block_end;
-                }
-            }
-            // Eat the trailing }
-            p++;
-        } else { // utf-8 -> ucs-2
-            // Escaped % symbol, eat the first one
-            if (p[0] == '%' && p[1] == '%')
-                p++;
+    font->metrics = METRICS_CONSTANT;
+    font->widths.w8 = NULL;
+    font->present = NULL;
+}
 
-            uint8_t *utf = (uint8_t *)p;
-            uint16_t ucs;
+// Collect the outcome of the OpenFont request, the metrics are queried only
+// if they couldn't be found in the cache.
+bool
+font_open_reply (font_t *font, xcb_void_cookie_t open_cookie, bool cached)
+{
+    xcb_query_font_reply_t *font_info = NULL;
+    xcb_generic_error_t *err;
+
+    // The QueryFont reply comes after any error for the OpenFont request,
+    // checking the latter doesn't cost another round-trip
+    if (!cached)
+        font_info = xcb_query_font_reply(c, xcb_query_font(c, font->ptr), NULL);
+    err = xcb_request_check(c, open_cookie);
+
+    if (err || (!cached && !font_info)) {
+        fprintf(stderr, "Could not load font \"%s\"\n", font->pattern);
+        if (!err)
+            xcb_close_font(c, font->ptr);
+        font->ptr = XCB_NONE;
+        font_metrics_free(font);
+        free(font_info);
+        free(err);
+        return false;
+    }
 
-            // ASCII
-            if (utf[0] < 0x80) {
-                ucs = utf[0];
-                p  += 1;
-            }
-            // Two byte utf8 sequence
-            else if ((utf[0] & 0xe0) == 0xc0) {
-                ucs = (utf[0] & 0x1f) << 6 | (utf[1] & 0x3f);
-                p += 2;
-            }
-            // Three byte utf8 sequence
-            else if ((utf[0] & 0xf0) == 0xe0) {
-                ucs = (utf[0] & 0xf) << 12 | (utf[1] & 0x3f) << 6 | (utf[2] & 0x3f);
-                p += 3;
-            }
-            // Four byte utf8 sequence
-            else if ((utf[0] & 0xf8) == 0xf0) {
-                ucs = 0xfffd;
-                p += 4;
-            }
-            // Five byte utf8 sequence
-            else if ((utf[0] & 0xfc) == 0xf8) {
-                ucs = 0xfffd;
-                p += 5;
-            }
-            // Six byte utf8 sequence
-            else if ((utf[0] & 0xfe) == 0xfc) {
-                ucs = 0xfffd;
-                p += 6;
-            }
-            // Not a valid utf-8 sequence
-            else {
-                ucs = utf[0];
-                p += 1;
-            }
+    if (cached)
+        return true;
 
-            cur_font = select_drawable_font(ucs);
-            if (!cur_font)
-                continue;
+    font->descent = font_info->font_descent;
+    font->ascent = font_info->font_ascent;
+    // The fonts loaded on demand already have the common height set
+    if (!font->height)
+        font->height = font_info->font_ascent + font_info->font_descent;
+    font->lbearing = min(font_info->min_bounds.left_side_bearing, 0);
+    font->rbearing = max(font_info->max_bounds.right_side_bearing, font_info->max_bounds.character_width);
+    font->width = font_info->max_bounds.character_width;
+    font->char_max = font_info->max_byte1 << 8 | font_info->max_char_or_byte2;
+    font->char_min = font_info->min_byte1 << 8 | font_info->min_char_or_byte2;
 
-            xcb_change_gc(c, gc[GC_DRAW] , XCB_GC_FONT, (const uint32_t []){ cur_font->ptr });
+    font_metrics_build(font, font_info);
+    font_cache_store(font);
 
-            int w = draw_char(cur_mon, cur_font, pos_x, align, ucs);
+    free(font_info);
 
-            pos_x += w;
-            area_shift(cur_mon->window, align, w);
-        }
-    }
+    return true;
 }
 
-void
-font_load (const char *pattern)
+bool
+font_open (font_t *font)
 {
-    xcb_query_font_cookie_t queryreq;
-    xcb_query_font_reply_t *font_info;
-    xcb_void_cookie_t cookie;
-    xcb_font_t font;
+    font->ptr = xcb_generate_id(c);
 
-    font = xcb_generate_id(c);
+    // The cached metrics only spare the QueryFont request, the font may have
+    // gone from the server since they were stored
+    const bool cached = font_cache_load(font);
+    const xcb_void_cookie_t open_cookie = xcb_open_font_checked(c, font->ptr, strlen(font->pattern), font->pattern);
 
-    cookie = xcb_open_font_checked(c, font, strlen(pattern), pattern);
-    if (xcb_request_check (c, cookie)) {
-        fprintf(stderr, "Could not load font \"%s\"\n", pattern);
-        return;
-    }
+    return font_open_reply(font, open_cookie, cached);
+}
 
-    font_t *ret = xcalloc(1, sizeof(font_t));
+#if WITH_RENDER
+// Rasterize the glyph and upload it to the server, the glyph id is the
+// character code. When drawing on the client side the bitmap is kept in the
+// glyph cache instead. Returns the advance or -1 if the font has no such glyph.
+int
+font_upload_glyph (font_t *font, const uint32_t ch)
+{
+    const FT_UInt index = FT_Get_Char_Index(font->face, ch);
+
+    if (!index || FT_Load_Glyph(font->face, index, FT_LOAD_RENDER | FT_LOAD_TARGET_LIGHT))
+        return -1;
 
-    queryreq = xcb_query_font(c, font);
-    font_info = xcb_query_font_reply(c, queryreq, NULL);
+    const FT_GlyphSlot slot = font->face->glyph;
+    const FT_Bitmap *bm = &slot->bitmap;
+    // The rows of the A8 images are padded to 32 bits
+    const unsigned stride = (bm->width + 3) & ~3;
+    uint8_t *data = xcalloc(stride * bm->rows + 1, 1);
 
-    ret->ptr = font;
-    ret->descent = font_info->font_descent;
-    ret->height = font_info->font_ascent + font_info->font_descent;
-    ret->width = font_info->max_bounds.character_width;
-    ret->char_max = font_info->max_byte1 << 8 | font_info->max_char_or_byte2;
-    ret->char_min = font_info->min_byte1 << 8 | font_info->min_char_or_byte2;
+    for (unsigned y = 0; y < bm->rows; y++) {
+        const uint8_t *row = bm->buffer + (int)y * bm->pitch;
 
-    // Copy over the width lut as it's part of font_info
-    size_t lut_size = sizeof(xcb_charinfo_t) *
-            xcb_query_font_char_infos_length(font_info);
-    if (lut_size) {
-        ret->width_lut = xmalloc(lut_size);
-        memcpy(ret->width_lut, xcb_query_font_char_infos(font_info), lut_size);
+        if (bm->pixel_mode == FT_PIXEL_MODE_MONO) {
+            for (unsigned x = 0; x < bm->width; x++)
+                data[y * stride + x] = (row[x >> 3] & (0x80 >> (x & 7))) ? 0xff : 0;
+        } else {
+            memcpy(data + y * stride, row, bm->width);
+        }
     }
 
-    free(font_info);
+    const xcb_render_glyphinfo_t info = {
+        .width = bm->width,
+        .height = bm->rows,
+        .x = -slot->bitmap_left,
+        .y = slot->bitmap_top,
+        .x_off = max((slot->advance.x + 32) >> 6, 0),
+        .y_off = 0,
+    };
+    const uint32_t id = ch;
 
-    font_list = xreallocarray(font_list, font_count + 1, sizeof(font_t));
-    if (!font_list) {
-        fprintf(stderr, "Failed to allocate %d font descriptors", font_count + 1);
-        exit(EXIT_FAILURE);
+    if (client_render) {
+        glyph_t *g = glyph_get(font, ch);
+
+        g->loaded = true;
+        g->x = slot->bitmap_left;
+        g->y = slot->bitmap_top;
+        g->width = stride;
+        g->height = bm->rows;
+        g->data = data;
+
+        return info.x_off;
     }
-    font_list[font_count++] = ret;
+
+    xcb_render_add_glyphs(c, font->glyphset, 1, &id, &info, stride * bm->rows, data);
+    free(data);
+
+    return info.x_off;
 }
+#endif
 
-enum {
-    NET_WM_WINDOW_TYPE,
-    NET_WM_WINDOW_TYPE_DOCK,
-    NET_WM_DESKTOP,
-    NET_WM_STRUT_PARTIAL,
-    NET_WM_STRUT,
-    NET_WM_STATE,
-    NET_WM_STATE_STICKY,
-    NET_WM_STATE_ABOVE,
-};
+bool
+font_has_glyph (font_t *font, const uint32_t c)
+{
+    // Open the font the first time it's needed, a font that can't be opened
+    // is left with an empty character range
+    if (font->pending) {
+        if (c < font->char_min || c > font->char_max)
+            return false;
+
+        font->pending = false;
+        if (!font_open(font)) {
+            font->char_min = 1;
+            font->char_max = 0;
+            return false;
+        }
+    }
+
+#if WITH_RENDER
+    if (font->face) {
+        int16_t *page = font->advance[c >> 8];
+
+        if (!page) {
+            page = xmalloc(256 * sizeof(int16_t));
+            memset(page, 0xff, 256 * sizeof(int16_t));
+            font->advance[c >> 8] = page;
+        }
+
+        if (page[c & 0xff] == ADVANCE_UNKNOWN) {
+            const int adv = font_upload_glyph(font, c);
+            page[c & 0xff] = (adv < 0) ? ADVANCE_MISSING : adv;
+        }
+
+        return page[c & 0xff] != ADVANCE_MISSING;
+    }
+#endif
+
+    if (c < font->char_min || c > font->char_max)
+        return false;
+
+    if (font->metrics == METRICS_CONSTANT) {
+        const unsigned i = c - font->char_min;
+        return !font->present || (font->present[i >> 3] & (1 << (i & 7)));
+    }
+
+    return char_width(font, c) != 0;
+}
 
 void
-set_ewmh_atoms (void)
+font_map_reset (void)
 {
-    const char *atom_names[] = {
-        "_NET_WM_WINDOW_TYPE",
-        "_NET_WM_WINDOW_TYPE_DOCK",
-        "_NET_WM_DESKTOP",
-        "_NET_WM_STRUT_PARTIAL",
-        "_NET_WM_STRUT",
-        "_NET_WM_STATE",
-        // Leave those at the end since are batch-set
-        "_NET_WM_STATE_STICKY",
-        "_NET_WM_STATE_ABOVE",
+    for (int i = 0; i < GLYPH_PAGES; i++) {
+        free(font_map[i]);
+        font_map[i] = NULL;
+    }
+}
+
+// returns NULL if character cannot be printed
+font_t *
+select_drawable_font (const uint32_t c)
+{
+    // If the user has specified a font to use, try that first.
+    if (font_index != -1 && font_has_glyph(font_list[font_index - 1], c))
+        return font_list[font_index - 1];
+
+    uint8_t *page = font_map[c >> 8];
+
+    if (!page) {
+        page = xmalloc(256);
+        memset(page, FONT_MAP_UNKNOWN, 256);
+        font_map[c >> 8] = page;
+    }
+
+    // Look for the first font that can draw the character only once
+    if (page[c & 0xff] == FONT_MAP_UNKNOWN) {
+        page[c & 0xff] = FONT_MAP_NONE;
+        for (int i = 0; i < font_count; i++) {
+            if (font_has_glyph(font_list[i], c)) {
+                page[c & 0xff] = i;
+                break;
+            }
+        }
+    }
+
+    return (page[c & 0xff] == FONT_MAP_NONE) ? NULL : font_list[page[c & 0xff]];
+}
+
+void
+layout_reset (layout_t *l)
+{
+    l->block_count = 0;
+    l->seg_count = 0;
+    l->glyph_count = 0;
+}
+
+unsigned
+layout_add_block (layout_t *l, monitor_t *mon, const int align)
+{
+    if (l->block_count == l->block_alloc) {
+        l->block_alloc = l->block_alloc ? l->block_alloc * 2 : 8;
+        l->blocks = xreallocarray(l->blocks, l->block_alloc, sizeof(block_t));
+    }
+
+    l->blocks[l->block_count] = (block_t){ .mon = mon, .align = align };
+
+    return l->block_count++;
+}
+
+// The segment inherits the current colors and attributes.
+seg_t *
+layout_add_seg (layout_t *l, const int type, const unsigned block, const int x)
+{
+    if (l->seg_count == l->seg_alloc) {
+        l->seg_alloc = l->seg_alloc ? l->seg_alloc * 2 : 32;
+        l->segs = xreallocarray(l->segs, l->seg_alloc, sizeof(seg_t));
+    }
+
+    seg_t *seg = &l->segs[l->seg_count++];
+    *seg = (seg_t){
+        .type = type,
+        .block = block,
+        .x = x,
+        .fg = fgc,
+        .bg = bgc,
+        .ul = ugc,
+        .attrs = attrs,
+        .glyph_begin = l->glyph_count,
     };
-    const int atoms = sizeof(atom_names)/sizeof(char *);
-    xcb_intern_atom_cookie_t atom_cookie[atoms];
-    xcb_atom_t atom_list[atoms];
-    xcb_intern_atom_reply_t *atom_reply;
 
-    // As suggested fetch all the cookies first (yum!) and then retrieve the
-    // atoms to exploit the async'ness
-    for (int i = 0; i < atoms; i++)
-        atom_cookie[i] = xcb_intern_atom(c, 0, strlen(atom_names[i]), atom_names[i]);
+    return seg;
+}
 
-    for (int i = 0; i < atoms; i++) {
-        atom_reply = xcb_intern_atom_reply(c, atom_cookie[i], NULL);
-        if (!atom_reply)
-            return;
-        atom_list[i] = atom_reply->atom;
-        free(atom_reply);
+void
+layout_add_glyph (layout_t *l, seg_t *seg, const uint32_t ch, const int width)
+{
+    if (l->glyph_count == l->glyph_alloc) {
+        l->glyph_alloc = l->glyph_alloc ? l->glyph_alloc * 2 : 256;
+        l->glyphs = xreallocarray(l->glyphs, l->glyph_alloc, sizeof(uint32_t));
     }
 
-    // Prepare the strut array
-    for (monitor_t *mon = monhead; mon; mon = mon->next) {
-        int strut[12] = {0};
-        if (topbar) {
-            strut[2] = bh;
-            strut[8] = mon->x;
-            strut[9] = mon->x + mon->width - 1;
+    l->glyphs[l->glyph_count++] = ch;
+    seg->glyph_len += 1;
+    seg->width += width;
+    seg->wide |= ch > 0xff;
+    l->blocks[seg->block].width += width;
+}
+
+// Now that every block has been measured place it on the screen.
+void
+layout_resolve (layout_t *l, const unsigned first_new_seg)
+{
+    for (unsigned i = 0; i < l->block_count; i++) {
+        block_t *blk = &l->blocks[i];
+
+        switch (blk->align) {
+            case ALIGN_L: blk->origin = 0; break;
+            case ALIGN_C: blk->origin = blk->mon->width / 2 - blk->width / 2; break;
+            case ALIGN_R: blk->origin = blk->mon->width - blk->width; break;
+        }
+    }
+
+    for (unsigned i = 0; i < l->seg_count; i++) {
+        seg_t *seg = &l->segs[i];
+        const block_t *blk = &l->blocks[seg->block];
+
+        if (seg->type == SEG_LINES) {
+            // Extend the lines from where the block ended to the new anchor
+            const int from = (blk->align == ALIGN_R) ? blk->origin : blk->origin + blk->width;
+            seg->left = min(from, seg->x);
+            seg->right = max(from, seg->x);
         } else {
-            strut[3]  = bh;
-            strut[10] = mon->x;
-            strut[11] = mon->x + mon->width - 1;
+            seg->left = blk->origin + seg->x;
+            seg->right = seg->left + seg->width;
         }
 
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_WINDOW_TYPE], XCB_ATOM_ATOM, 32, 1, &atom_list[NET_WM_WINDOW_TYPE_DOCK]);
-        xcb_change_property(c, XCB_PROP_MODE_APPEND,  mon->window, atom_list[NET_WM_STATE], XCB_ATOM_ATOM, 32, 2, &atom_list[NET_WM_STATE_STICKY]);
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_DESKTOP], XCB_ATOM_CARDINAL, 32, 1, (const uint32_t []){ -1 } );
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_STRUT_PARTIAL], XCB_ATOM_CARDINAL, 32, 12, strut);
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, atom_list[NET_WM_STRUT], XCB_ATOM_CARDINAL, 32, 4, strut);
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, 3, "bar");
-        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, 12, "lemonbar\0Bar");
+        // The segments carried over from the previous line are already hashed
+        if (i < first_new_seg && seg->type != SEG_LINES)
+            continue;
+
+        // Two segments with the same hash look the same wherever they're drawn
+        const uint32_t key[] = {
+            seg->type, seg->right - seg->left,
+            seg->fg.v, seg->bg.v, seg->ul.v,
+            seg->attrs & (ATTR_OVERL | ATTR_UNDERL),
+        };
+        seg->hash = fnv1a(key, sizeof(key), FNV1A_INIT);
+        seg->hash = fnv1a(&seg->font, sizeof(seg->font), seg->hash);
+        seg->hash = fnv1a(l->glyphs + seg->glyph_begin,
+                seg->glyph_len * sizeof(uint32_t), seg->hash);
     }
+
 }
 
-monitor_t *
-monitor_new (int x, int y, int width, int height, char *name)
+void
+damage_add (monitor_t *mon, int begin, int end)
 {
-    monitor_t *ret;
+    begin = max(begin, 0);
+    end = min(end, mon->width);
+    if (begin >= end)
+        return;
 
-    ret = xcalloc(1, sizeof(monitor_t));
-    ret->name = name;
-    ret->x = x;
-    ret->y = (topbar ? by : height - bh - by) + y;
-    ret->width = width;
-    ret->height = height;
-    ret->next = ret->prev = NULL;
-    ret->window = xcb_generate_id(c);
+    if (mon->dirty_count == mon->dirty_alloc) {
+        mon->dirty_alloc = mon->dirty_alloc ? mon->dirty_alloc * 2 : 8;
+        mon->dirty = xreallocarray(mon->dirty, mon->dirty_alloc, sizeof(span_t));
+    }
+
+    mon->dirty[mon->dirty_count++] = (span_t){ begin, end };
+}
+
+int
+span_sort_cb (const void *p1, const void *p2)
+{
+    const span_t *s1 = (span_t *)p1;
+    const span_t *s2 = (span_t *)p2;
+
+    return s1->begin - s2->begin;
+}
+
+// Sort the spans and coalesce the overlapping and adjacent ones.
+void
+damage_merge (monitor_t *mon)
+{
+    unsigned n = 0;
+
+    if (!mon->dirty_count)
+        return;
+
+    qsort(mon->dirty, mon->dirty_count, sizeof(span_t), span_sort_cb);
+
+    for (unsigned i = 1; i < mon->dirty_count; i++) {
+        if (mon->dirty[i].begin <= mon->dirty[n].end)
+            mon->dirty[n].end = max(mon->dirty[n].end, mon->dirty[i].end);
+        else
+            mon->dirty[++n] = mon->dirty[i];
+    }
+
+    mon->dirty_count = n + 1;
+}
+
+bool
+damage_hit (const monitor_t *mon, const int begin, const int end)
+{
+    for (unsigned i = 0; i < mon->dirty_count; i++) {
+        if (begin < mon->dirty[i].end && end > mon->dirty[i].begin)
+            return true;
+    }
+    return false;
+}
+
+bool
+damage_covers (const monitor_t *mon, const int begin, const int end)
+{
+    for (unsigned i = 0; i < mon->dirty_count; i++) {
+        if (begin >= mon->dirty[i].begin && end <= mon->dirty[i].end)
+            return true;
+    }
+    return false;
+}
+
+int
+seg_sort_cb (const void *p1, const void *p2)
+{
+    const seg_t *s1 = *(seg_t **)p1;
+    const seg_t *s2 = *(seg_t **)p2;
+
+    if (s1->left != s2->left)
+        return s1->left - s2->left;
+    if (s1->hash != s2->hash)
+        return s1->hash < s2->hash ? -1 : 1;
+    return 0;
+}
+
+// Collect the segments drawn on the monitor, sorted by position and hash.
+unsigned
+layout_collect (const layout_t *l, const monitor_t *mon, seg_t **out)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < l->seg_count; i++) {
+        seg_t *seg = &l->segs[i];
+        if (l->blocks[seg->block].mon == mon && seg->right > seg->left)
+            out[n++] = seg;
+    }
+
+    qsort(out, n, sizeof(seg_t *), seg_sort_cb);
+
+    return n;
+}
+
+int
+mirror_group (const monitor_t *mon)
+{
+    for (int i = 0; mon->name && i < num_mirrors; i++) {
+        if (!strcmp(mirror_names[i], mon->name))
+            return mirror_groups[i];
+    }
+
+    return -1;
+}
+
+// Whether the two monitors are given the very same segments
+bool
+layout_same (const layout_t *l, const monitor_t *a, const monitor_t *b)
+{
+    seg_t **sa = xreallocarray(NULL, 2 * l->seg_count + 1, sizeof(seg_t *));
+    seg_t **sb = sa + l->seg_count;
+    const unsigned na = layout_collect(l, a, sa);
+    const unsigned nb = layout_collect(l, b, sb);
+    bool same = na == nb;
+
+    for (unsigned i = 0; same && i < na; i++) {
+        same = sa[i]->left == sb[i]->left && sa[i]->right == sb[i]->right &&
+            sa[i]->hash == sb[i]->hash;
+    }
+
+    free(sa);
+
+    return same;
+}
+
+void
+monitor_mirror (monitor_t *mon, monitor_t *leader)
+{
+    if (!mon->mirror) {
+        xcb_free_pixmap(c, mon->pixmap);
+        image_destroy(mon);
+    }
 
+    mon->mirror = leader;
+    mon->pixmap = leader->pixmap;
+}
+
+void
+monitor_unmirror (monitor_t *mon)
+{
     int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
-    xcb_create_window(c, depth, ret->window, scr->root,
-            ret->x, ret->y, width, bh, 0,
-            XCB_WINDOW_CLASS_INPUT_OUTPUT, visual,
-            XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP,
-            (const uint32_t []){ bgc.v, bgc.v, dock, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS, colormap });
 
-    ret->pixmap = xcb_generate_id(c);
-    xcb_create_pixmap(c, depth, ret->pixmap, ret->window, width, bh);
+    mon->mirror = NULL;
+    mon->pixmap = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, mon->pixmap, mon->window, mon->width, bh);
+
+    if (client_render)
+        image_create(mon);
+}
+
+// A monitor of the same width as a previous one either declared in the same
+// -m group or given the very same segments shows that monitor's pixmap, only
+// the first monitor of the set is drawn. The monitors whose state changes are
+// repainted as a whole.
+void
+mirrors_update (const layout_t *l)
+{
+    if (!monhead->next)
+        return;
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        mon->content = 0;
+
+    for (unsigned i = 0; i < l->seg_count; i++) {
+        const seg_t *seg = &l->segs[i];
+        const uint64_t key[] = { seg->left, seg->right, seg->hash };
+
+        if (seg->right > seg->left)
+            l->blocks[seg->block].mon->content += fnv1a(key, sizeof(key), FNV1A_INIT);
+    }
+
+    for (monitor_t *mon = monhead->next; mon; mon = mon->next) {
+        const int group = mirror_group(mon);
+        monitor_t *leader = NULL;
+
+        for (monitor_t *m = monhead; m != mon && !leader; m = m->next) {
+            if (m->mirror || m->width != mon->width)
+                continue;
+
+            if ((group >= 0 && mirror_group(m) == group) ||
+                    (m->content == mon->content && layout_same(l, m, mon)))
+                leader = m;
+        }
+
+        if (leader == mon->mirror)
+            continue;
+
+        if (leader)
+            monitor_mirror(mon, leader);
+        else
+            monitor_unmirror(mon);
+
+        damage_add(mon, 0, mon->width);
+    }
+}
+
+typedef struct seg_ref_t {
+    monitor_t *mon;
+    seg_t *seg;
+} seg_ref_t;
+
+int
+seg_ref_sort_cb (const void *p1, const void *p2)
+{
+    const seg_ref_t *r1 = (seg_ref_t *)p1;
+    const seg_ref_t *r2 = (seg_ref_t *)p2;
+
+    if (r1->mon != r2->mon)
+        return (uintptr_t)r1->mon < (uintptr_t)r2->mon ? -1 : 1;
+
+    return seg_sort_cb(&r1->seg, &r2->seg);
+}
+
+// Collect the segments drawn on every monitor but the mirrors, grouped by
+// monitor and sorted by position and hash.
+unsigned
+layout_collect_all (const layout_t *l, seg_ref_t *out)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < l->seg_count; i++) {
+        seg_t *seg = &l->segs[i];
+        monitor_t *mon = l->blocks[seg->block].mon;
+
+        if (!mon->mirror && seg->right > seg->left)
+            out[n++] = (seg_ref_t){ mon, seg };
+    }
+
+    qsort(out, n, sizeof(seg_ref_t), seg_ref_sort_cb);
+
+    return n;
+}
+
+// Every segment that's not present in both the layouts marks its extent as
+// dirty. The segments partially covered by a dirty span are then redrawn as a
+// whole, thus the spans are grown until they contain every segment they touch.
+// Both the layouts are walked once for all the monitors, those the line didn't
+// change end up with no dirty span at all and aren't touched.
+void
+damage_compute (const layout_t *old, const layout_t *new)
+{
+    seg_ref_t *a = xreallocarray(NULL, old->seg_count + new->seg_count + 1, sizeof(seg_ref_t));
+    seg_ref_t *b = a + old->seg_count;
+    const unsigned na = layout_collect_all(old, a);
+    const unsigned nb = layout_collect_all(new, b);
+    unsigned i = 0, j = 0;
+
+    while (i < na || j < nb) {
+        const int cmp = (i == na) ? 1 : (j == nb) ? -1 : seg_ref_sort_cb(&a[i], &b[j]);
+
+        if (cmp == 0 && a[i].seg->right == b[j].seg->right) {
+            i++, j++;
+        } else if (cmp <= 0) {
+            damage_add(a[i].mon, a[i].seg->left, a[i].seg->right);
+            i++;
+        } else {
+            damage_add(b[j].mon, b[j].seg->left, b[j].seg->right);
+            j++;
+        }
+    }
+
+    for (unsigned first = 0, last; first < nb; first = last) {
+        monitor_t *mon = b[first].mon;
+
+        for (last = first; last < nb && b[last].mon == mon; last++)
+            ;
+
+        for (bool grown = mon->dirty_count != 0; grown; ) {
+            grown = false;
+            damage_merge(mon);
+
+            for (j = first; j < last; j++) {
+                const seg_t *seg = b[j].seg;
+
+                if (damage_hit(mon, seg->left, seg->right) &&
+                        !damage_covers(mon, seg->left, seg->right)) {
+                    damage_add(mon, seg->left, seg->right);
+                    grown = true;
+                }
+            }
+        }
+    }
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        damage_merge(mon);
+
+    free(a);
+}
+
+// Clear the dirty spans and draw the segments falling in there.
+#define GLYPH_FETCH_MAX 64
+
+// Draw the core font glyphs side by side in a scratch pixmap and read them
+// back with a single GetImage, the coverage is taken from the green channel.
+void
+glyphs_fetch_font (font_t *font, const uint32_t *chars, const unsigned n)
+{
+    const int cw = font->rbearing - font->lbearing;
+    const int ch = font->ascent + font->descent;
+    const int w = cw * n;
+    xcb_get_image_reply_t *reply;
+    xcb_pixmap_t strip;
+
+    strip = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, strip, monhead->pixmap, w, ch);
+    fill_rect(strip, gc_get((rgba_t)0U, NULL), 0, 0, w, ch);
+
+    const xcb_gcontext_t gc = gc_get(WHITE, font);
+    for (unsigned i = 0; i < n; i++)
+        xcb_poly_text_simple(c, strip, gc, i * cw - font->lbearing, font->ascent, chars[i] > 0xff, 1, &chars[i]);
+
+    reply = xcb_get_image_reply(c, xcb_get_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, strip, 0, 0, w, ch, ~0U), NULL);
+    xcb_free_pixmap(c, strip);
+
+    if (!reply || xcb_get_image_data_length(reply) < w * ch * 4) {
+        fprintf(stderr, "Could not fetch the glyphs\n");
+        free(reply);
+        return;
+    }
+
+    const uint32_t *px = (const uint32_t *)xcb_get_image_data(reply);
+
+    for (unsigned i = 0; i < n; i++) {
+        glyph_t *g = glyph_get(font, chars[i]);
+
+        g->x = font->lbearing;
+        g->y = font->ascent;
+        g->width = cw;
+        g->height = ch;
+        g->data = xmalloc(cw * ch);
+
+        for (int y = 0; y < ch; y++)
+            for (int x = 0; x < cw; x++)
+                g->data[y * cw + x] = px[y * w + i * cw + x] >> 8;
+        g->loaded = true;
+    }
+
+    free(reply);
+}
+
+// Make sure the bitmaps of the glyphs about to be drawn are available, this
+// costs a round-trip per font only when new glyphs show up.
+void
+glyphs_fetch (const layout_t *l)
+{
+    uint32_t pending[GLYPH_FETCH_MAX];
+
+    for (int f = 0; f < font_count; f++) {
+        font_t *font = font_list[f];
+        unsigned n = 0;
+
+        // The outline fonts are rasterized when the glyph is looked up and
+        // the fonts not opened yet have nothing to draw
+        if (font->ptr == XCB_NONE)
+            continue;
+
+        for (unsigned i = 0; i < l->seg_count; i++) {
+            const seg_t *seg = &l->segs[i];
+
+            if (seg->type != SEG_TEXT || seg->font != font)
+                continue;
+            if (!damage_hit(l->blocks[seg->block].mon, seg->left, seg->right))
+                continue;
+
+            for (unsigned j = 0; j < seg->glyph_len; j++) {
+                const uint32_t ch = l->glyphs[seg->glyph_begin + j];
+                glyph_t *g = glyph_get(font, ch);
+
+                // The glyph is marked as loaded once its bitmap is stored, a
+                // failed fetch is tried again on the next line
+                if (g->loaded)
+                    continue;
+
+                unsigned k = 0;
+                while (k < n && pending[k] != ch)
+                    k++;
+                if (k < n)
+                    continue;
+
+                pending[n++] = ch;
+
+                if (n == GLYPH_FETCH_MAX) {
+                    glyphs_fetch_font(font, pending, n);
+                    n = 0;
+                }
+            }
+        }
+
+        if (n)
+            glyphs_fetch_font(font, pending, n);
+    }
+}
+
+// Draw the damaged parts of a single monitor in its image, this touches no
+// global state besides the image so it's safe to run on the worker threads.
+void
+image_render_monitor (monitor_t *mon, const layout_t *l)
+{
+    if (!mon->dirty_count || mon->mirror)
+        return;
+
+    for (unsigned i = 0; i < mon->dirty_count; i++)
+        image_fill(mon, mon->dirty[i].begin, 0, mon->dirty[i].end - mon->dirty[i].begin, bh, dbgc);
+
+    for (unsigned i = 0; i < l->seg_count; i++) {
+        const seg_t *seg = &l->segs[i];
+
+        if (l->blocks[seg->block].mon == mon && damage_hit(mon, seg->left, seg->right))
+            image_draw_seg(mon, l, seg);
+    }
+}
+
+// Called with the lock held, hand out the monitors left to draw until there
+// are none left.
+void
+workers_drain (void)
+{
+    while (workers.next) {
+        monitor_t *mon = workers.next;
+
+        workers.next = mon->next;
+        workers.busy++;
+
+        pthread_mutex_unlock(&workers.lock);
+        image_render_monitor(mon, workers.layout);
+        pthread_mutex_lock(&workers.lock);
+
+        if (--workers.busy == 0 && !workers.next)
+            pthread_cond_signal(&workers.done);
+    }
+}
+
+void *
+worker_main (void *arg)
+{
+    unsigned long frame = 0;
+
+    (void)arg;
+
+    pthread_mutex_lock(&workers.lock);
+    for (;;) {
+        while (!workers.quit && workers.frame == frame)
+            pthread_cond_wait(&workers.work, &workers.lock);
+
+        if (workers.quit)
+            break;
+
+        frame = workers.frame;
+        workers_drain();
+    }
+    pthread_mutex_unlock(&workers.lock);
+
+    return NULL;
+}
+
+void
+workers_start (const int count)
+{
+    workers.threads = xcalloc(count, sizeof(pthread_t));
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers.threads[i], NULL, worker_main, NULL)) {
+            fprintf(stderr, "Couldn't create the worker threads\n");
+            break;
+        }
+        workers.count++;
+    }
+}
+
+void
+workers_stop (void)
+{
+    pthread_mutex_lock(&workers.lock);
+    workers.quit = true;
+    pthread_cond_broadcast(&workers.work);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (int i = 0; i < workers.count; i++)
+        pthread_join(workers.threads[i], NULL);
+
+    free(workers.threads);
+    workers.threads = NULL;
+    workers.count = 0;
+    workers.quit = false;
+}
+
+// Use a thread per monitor at most, the main thread draws one too
+void
+workers_setup (void)
+{
+    int count = 0, want = 0;
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        count++;
+
+    if (client_render && thread_count > 1 && count > 1)
+        want = min(thread_count, count) - 1;
+
+    if (want == workers.count)
+        return;
+
+    if (workers.count)
+        workers_stop();
+    if (want)
+        workers_start(want);
+}
+
+// Draw the damaged parts in the client side image and upload them
+void
+image_render (const layout_t *l)
+{
+#if WITH_SHM
+    // Wait for the server to be done with the previous frame before touching
+    // the shared memory again
+    if (shm_busy) {
+        free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL));
+        shm_busy = false;
+    }
+#endif
+
+    // The X requests are only issued from the main thread, the glyphs have
+    // to be in place before the workers start drawing
+    glyphs_fetch(l);
+
+    if (workers.count) {
+        // Let the workers pick the monitors, the main thread helps too
+        pthread_mutex_lock(&workers.lock);
+        workers.layout = l;
+        workers.next = monhead;
+        workers.frame++;
+        pthread_cond_broadcast(&workers.work);
+
+        workers_drain();
+        while (workers.busy || workers.next)
+            pthread_cond_wait(&workers.done, &workers.lock);
+        pthread_mutex_unlock(&workers.lock);
+    } else {
+        for (monitor_t *m = monhead; m != NULL; m = m->next)
+            image_render_monitor(m, l);
+    }
+
+    for (monitor_t *m = monhead; m != NULL; m = m->next) {
+        if (!m->mirror)
+            image_push(m);
+    }
+}
+
+void
+render (const layout_t *l)
+{
+    if (client_render) {
+        image_render(l);
+        return;
+    }
+
+    const xcb_gcontext_t gc_clear = gc_get(dbgc, NULL);
+
+    for (monitor_t *m = monhead; m != NULL; m = m->next) {
+        xcb_rectangle_t rects[m->dirty_count + 1];
+
+        if (m->mirror)
+            continue;
+
+        for (unsigned i = 0; i < m->dirty_count; i++)
+            rects[i] = (xcb_rectangle_t){ m->dirty[i].begin, 0, m->dirty[i].end - m->dirty[i].begin, bh };
+
+        if (m->dirty_count)
+            xcb_poly_fill_rectangle(c, m->pixmap, gc_clear, m->dirty_count, rects);
+    }
+
+    for (unsigned i = 0; i < l->seg_count; i++) {
+        const seg_t *seg = &l->segs[i];
+        const monitor_t *mon = l->blocks[seg->block].mon;
+
+        if (!mon->mirror && damage_hit(mon, seg->left, seg->right))
+            draw_seg(l, seg);
+    }
+}
+
+// Pick the monitor given by the S specifier at *p and move past it
+monitor_t *
+monitor_select (monitor_t *cur_mon, char **p, const char *block_end)
+{
+    monitor_t *orig_mon = cur_mon;
+
+    switch (**p) {
+        case '+': // Next monitor.
+            if (cur_mon->next) cur_mon = cur_mon->next;
+            *p += 1;
+            break;
+        case '-': // Previous monitor.
+            if (cur_mon->prev) cur_mon = cur_mon->prev;
+            *p += 1;
+            break;
+        case 'f': // First monitor.
+            cur_mon = monhead;
+            *p += 1;
+            break;
+        case 'l': // Last monitor.
+            cur_mon = montail ? montail : monhead;
+            *p += 1;
+            break;
+        case 'n': { // Named monitor.
+            const size_t name_len = block_end - (*p + 1);
+            cur_mon = monhead;
+            while (cur_mon) {
+                if (cur_mon->name &&
+                        !strncmp(cur_mon->name, *p + 1, name_len) &&
+                        cur_mon->name[name_len] == '\0')
+                    break;
+                cur_mon = cur_mon->next;
+            }
+            if (!cur_mon) cur_mon = orig_mon;
+            *p += 1 + name_len;
+        } break;
+        case '0' ... '9': // Numbered monitor.
+            cur_mon = monhead;
+            for (int i = 0; i != **p-'0' && cur_mon->next; i++)
+                cur_mon = cur_mon->next;
+            *p += 1;
+            break;
+        default:
+            fprintf(stderr, "Unknown S specifier '%c'\n", *(*p)++);
+            break;
+    }
+
+    return cur_mon;
+}
+
+// Start a new block with the given alignment, the lines over or under the text
+// are drawn up to the anchor of the new block
+unsigned
+layout_align (monitor_t *mon, const unsigned block, const int align)
+{
+    const int anchor[] = { 0, mon->width / 2, mon->width };
+
+    if (attrs & (ATTR_OVERL | ATTR_UNDERL))
+        layout_add_seg(lay, SEG_LINES, block, anchor[align]);
+
+    return layout_add_block(lay, mon, align);
+}
+
+// Measure the glyphs and append them to the current run, the whole run is
+// drawn at once when the line is complete
+void
+layout_add_text (const uint32_t *ucs, const size_t n, const unsigned block, int *pos_x, seg_t **run)
+{
+    for (size_t i = 0; i < n; i++) {
+        font_t *cur_font = select_drawable_font(ucs[i]);
+        if (!cur_font)
+            continue;
+
+        if (!*run || (*run)->font != cur_font) {
+            *run = layout_add_seg(lay, SEG_TEXT, block, *pos_x);
+            (*run)->font = cur_font;
+        }
+
+        const int w = char_width(cur_font, ucs[i]);
+        layout_add_glyph(lay, *run, ucs[i], w);
+
+        *pos_x += w;
+    }
+}
+
+// Read a small file from /proc or /sys, the whole of it fits in the buffer
+bool
+prov_read (const char *path, char *buf, const size_t size)
+{
+    size_t len = 0;
+    ssize_t r;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
+    while (len < size - 1 && (r = read(fd, buf + len, size - 1 - len)) > 0)
+        len += r;
+    close(fd);
+    buf[len] = '\0';
+
+    return len > 0;
+}
+
+// Print a byte count with a binary unit suffix
+void
+prov_human (char *buf, const size_t size, double v)
+{
+    const char units[] = "BKMGT";
+    int u = 0;
+
+    while (v >= 1000 && u < 4) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, size, u ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+bool
+prov_time (prov_t *p)
+{
+    const time_t t = time(NULL);
+    struct tm tm;
+
+    if (!localtime_r(&t, &tm))
+        return false;
+
+    // An empty result is fine, there's no way to tell it from an error
+    p->text[0] = '\0';
+    strftime(p->text, sizeof(p->text), p->arg ? p->arg : "%H:%M", &tm);
+
+    return true;
+}
+
+// The share of the time spent out of the idle task since the last update
+bool
+prov_cpu (prov_t *p)
+{
+    char buf[512];
+    unsigned long long v[8] = { 0 };
+
+    if (!prov_read("/proc/stat", buf, sizeof(buf)) ||
+            sscanf(buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4)
+        return false;
+
+    uint64_t total = 0;
+    for (int i = 0; i < 8; i++)
+        total += v[i];
+    const uint64_t idle = v[3] + v[4];
+
+    const uint64_t d_total = total - p->last[0];
+    const uint64_t d_idle = idle - p->last[1];
+    p->last[0] = total;
+    p->last[1] = idle;
+
+    snprintf(p->text, sizeof(p->text), "%d%%", d_total ? (int)((d_total - d_idle) * 100 / d_total) : 0);
+
+    return true;
+}
+
+// The share of the memory that's not available to the programs
+bool
+prov_mem (prov_t *p)
+{
+    char buf[1024];
+    unsigned long long total, avail;
+    const char *q, *r;
+
+    if (!prov_read("/proc/meminfo", buf, sizeof(buf)) ||
+            !(q = strstr(buf, "MemTotal:")) || !(r = strstr(buf, "MemAvailable:")) ||
+            sscanf(q, "MemTotal: %llu", &total) != 1 ||
+            sscanf(r, "MemAvailable: %llu", &avail) != 1 || !total || avail > total)
+        return false;
+
+    snprintf(p->text, sizeof(p->text), "%d%%", (int)((total - avail) * 100 / total));
+
+    return true;
+}
+
+bool
+prov_load (prov_t *p)
+{
+    char buf[128];
+
+    if (!prov_read("/proc/loadavg", buf, sizeof(buf)))
+        return false;
+
+    snprintf(p->text, sizeof(p->text), "%.*s", (int)strcspn(buf, " \n"), buf);
+
+    return true;
+}
+
+bool
+prov_battery (prov_t *p)
+{
+    char path[PATH_MAX], buf[32];
+
+    snprintf(path, sizeof(path), "/sys/class/power_supply/%s/capacity", p->arg ? p->arg : "BAT0");
+    if (!prov_read(path, buf, sizeof(buf)) || !isdigit(buf[0]))
+        return false;
+
+    snprintf(p->text, sizeof(p->text), "%d%%", atoi(buf));
+
+    return true;
+}
+
+// The receive and transmit rates of the given interface, or of all of them but
+// the loopback one
+bool
+prov_net (prov_t *p)
+{
+    char buf[8192], rx_str[16], tx_str[16];
+    unsigned long long rx = 0, tx = 0;
+    struct timespec now;
+    bool found = false;
+
+    if (!prov_read("/proc/net/dev", buf, sizeof(buf)))
+        return false;
+
+    for (char *line = buf; *line; line += strcspn(line, "\n") + (line[strcspn(line, "\n")] != '\0')) {
+        char *colon = strchr(line, ':');
+        unsigned long long r, t;
+
+        if (!colon || colon > line + strcspn(line, "\n"))
+            continue;
+
+        const char *name = line + strspn(line, " ");
+        const size_t name_len = colon - name;
+
+        if (p->arg ? (strlen(p->arg) != name_len || strncmp(name, p->arg, name_len))
+                   : (name_len == 2 && !strncmp(name, "lo", 2)))
+            continue;
+
+        if (sscanf(colon + 1, "%llu %*u %*u %*u %*u %*u %*u %*u %llu", &r, &t) != 2)
+            continue;
+
+        rx += r;
+        tx += t;
+        found = true;
+    }
+    if (!found)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - p->last_time.tv_sec) + (now.tv_nsec - p->last_time.tv_nsec) / 1e9;
+    // The first update has nothing to compare with
+    if (!p->last_time.tv_sec && !p->last_time.tv_nsec)
+        elapsed = 0;
+
+    prov_human(rx_str, sizeof(rx_str), elapsed > 0 && rx >= p->last[0] ? (rx - p->last[0]) / elapsed : 0);
+    prov_human(tx_str, sizeof(tx_str), elapsed > 0 && tx >= p->last[1] ? (tx - p->last[1]) / elapsed : 0);
+    snprintf(p->text, sizeof(p->text), "%s %s", rx_str, tx_str);
+
+    p->last[0] = rx;
+    p->last[1] = tx;
+    p->last_time = now;
+
+    return true;
+}
+
+static const provider_t providers[] = {
+    { "time", 1, prov_time },
+    { "cpu", 2, prov_cpu },
+    { "mem", 5, prov_mem },
+    { "load", 5, prov_load },
+    { "battery", 30, prov_battery },
+    { "net", 2, prov_net },
+};
+
+// Wake up in the given time or less, the deadlines closer than this are met
+// on the same wakeup
+#define PROV_SLACK_NS 50000000LL
+
+// Schedule the next update on a multiple of the interval on the wall clock,
+// the providers due at the same time are updated on a single wakeup and the
+// clock changes along with the second
+void
+prov_schedule (prov_t *p)
+{
+    struct timespec mono, real;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    const long long period = p->interval * 1000000000LL;
+    const long long into = (real.tv_sec % p->interval) * 1000000000LL + real.tv_nsec;
+    long long ns = period - into;
+    // Updated a bit early, don't do it twice
+    if (ns < PROV_SLACK_NS)
+        ns += period;
+
+    ns += mono.tv_nsec;
+    p->next.tv_sec = mono.tv_sec + ns / 1000000000LL;
+    p->next.tv_nsec = ns % 1000000000LL;
+}
+
+// Returns true if the text changed
+bool
+prov_update (prov_t *p)
+{
+    char old[sizeof(p->text)];
+
+    memcpy(old, p->text, sizeof(old));
+    if (p->type->update(p)) {
+        p->failed = false;
+    } else {
+        if (!p->failed)
+            fprintf(stderr, "Couldn't read the data for the %s provider\n", p->type->name);
+        p->failed = true;
+        p->text[0] = '\0';
+    }
+    prov_schedule(p);
+
+    return strcmp(old, p->text) != 0;
+}
+
+long long
+prov_due_in (const prov_t *p)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (p->next.tv_sec - now.tv_sec) * 1000000000LL + (p->next.tv_nsec - now.tv_nsec);
+}
+
+// Parse the ":name[:argument]" following a P in a formatting block and return
+// the index of the provider, -1 if there's no such provider
+int
+prov_get (const char *str, const char *block_end)
+{
+    const provider_t *type = NULL;
+
+    if (*str != ':') {
+        fprintf(stderr, "Invalid provider block\n");
+        return -1;
+    }
+    str++;
+
+    const char *name_end = memchr(str, ':', block_end - str);
+    if (!name_end)
+        name_end = block_end;
+
+    for (size_t i = 0; i < sizeof(providers) / sizeof(*providers); i++) {
+        if (!strncmp(providers[i].name, str, name_end - str) && !providers[i].name[name_end - str])
+            type = &providers[i];
+    }
+    if (!type) {
+        fprintf(stderr, "Unknown provider \"%.*s\"\n", (int)(name_end - str), str);
+        return -1;
+    }
+
+    const char *arg = (name_end < block_end) ? name_end + 1 : NULL;
+    const size_t arg_len = arg ? (size_t)(block_end - arg) : 0;
+
+    for (unsigned i = 0; i < provs.count; i++) {
+        prov_t *p = &provs.ptr[i];
+
+        if (p->type != type || !p->arg != !arg || (arg && (strlen(p->arg) != arg_len || strncmp(p->arg, arg, arg_len))))
+            continue;
+
+        // It may have been left out of the line for a while
+        if (prov_due_in(p) <= PROV_SLACK_NS)
+            (void)prov_update(p);
+        return i;
+    }
+
+    if (provs.count == provs.alloc) {
+        provs.alloc = provs.alloc ? provs.alloc * 2 : 8;
+        provs.ptr = xreallocarray(provs.ptr, provs.alloc, sizeof(prov_t));
+    }
+
+    prov_t *p = &provs.ptr[provs.count];
+    *p = (prov_t){
+        .type = type,
+        .interval = type->interval,
+        .offset = SIZE_MAX,
+    };
+    if (arg) {
+        p->arg = xmalloc(arg_len + 1);
+        memcpy(p->arg, arg, arg_len);
+        p->arg[arg_len] = '\0';
+    }
+
+    // A clock not showing the seconds changes once a minute
+    if (type->update == prov_time) {
+        p->interval = 60;
+        for (const char *q = p->arg ? p->arg : ""; (q = strchr(q, '%')) && q[1]; q += 2) {
+            if (strchr("cEOrsSTX+", q[1]))
+                p->interval = 1;
+        }
+    }
+
+    (void)prov_update(p);
+
+    return provs.count++;
+}
+
+void
+prov_draw (const prov_t *p, const unsigned block, int *pos_x, seg_t **run)
+{
+    const size_t len = strlen(p->text);
+
+    if (len > ucs_alloc) {
+        ucs_alloc = len;
+        ucs_buf = xreallocarray(ucs_buf, ucs_alloc, sizeof(uint32_t));
+    }
+
+    const size_t n = utf8_decode(p->text, len, ucs_buf);
+    layout_add_text(ucs_buf, n, block, pos_x, run);
+}
+
+// Lay out the line, draw what changed and make it the one being displayed
+void
+layout_commit (const unsigned first_new_seg)
+{
+    layout_resolve(lay, first_new_seg);
+    mirrors_update(lay);
+
+    // Repaint only what changed since the previous line, the mirrors copy
+    // whatever changed in the pixmap they share
+    damage_compute(prev_lay, lay);
+    for (monitor_t *m = monhead; m != NULL; m = m->next) {
+        if (!m->mirror)
+            continue;
+        for (unsigned i = 0; i < m->mirror->dirty_count; i++)
+            damage_add(m, m->mirror->dirty[i].begin, m->mirror->dirty[i].end);
+        damage_merge(m);
+    }
+    render(lay);
+
+    layout_t *tmp = prev_lay;
+    prev_lay = lay;
+    lay = tmp;
+}
+
+void
+layout_copy_prefix (layout_t *dst, const layout_t *src, const checkpoint_t *ck)
+{
+    if (dst->block_alloc < ck->block_count) {
+        dst->block_alloc = src->block_alloc;
+        dst->blocks = xreallocarray(dst->blocks, dst->block_alloc, sizeof(block_t));
+    }
+    if (dst->seg_alloc < ck->seg_count) {
+        dst->seg_alloc = src->seg_alloc;
+        dst->segs = xreallocarray(dst->segs, dst->seg_alloc, sizeof(seg_t));
+    }
+    if (dst->glyph_alloc < ck->glyph_count) {
+        dst->glyph_alloc = src->glyph_alloc;
+        dst->glyphs = xreallocarray(dst->glyphs, dst->glyph_alloc, sizeof(uint32_t));
+    }
+
+    memcpy(dst->blocks, src->blocks, ck->block_count * sizeof(block_t));
+    memcpy(dst->segs, src->segs, ck->seg_count * sizeof(seg_t));
+    memcpy(dst->glyphs, src->glyphs, ck->glyph_count * sizeof(uint32_t));
+
+    dst->block_count = ck->block_count;
+    dst->seg_count = ck->seg_count;
+    dst->glyph_count = ck->glyph_count;
+}
+
+void
+parse (char *text)
+{
+    monitor_t *cur_mon;
+    unsigned cur_block;
+    seg_t *run;
+    int pos_x, align, button;
+    char *p, *block_end, *ep;
+    const size_t len = strcspn(text, "\n");
+    checkpoint_t *ck = NULL;
+    bool can_resume = true;
+    size_t same = 0, block_offset = 0;
+
+    if (line_valid) {
+        // Find the first byte that differs from the previous line
+        const size_t common = min(len, line_len);
+        while (same < common && text[same] == line_prev[same])
+            same++;
+        // The text of a provider block changed
+        same = min(same, provs.dirty_from);
+
+        // Nothing to do if the line didn't change at all
+        if (same == len && len == line_len)
+            return;
+    }
+    provs.dirty_from = SIZE_MAX;
+
+    if (len + 1 > line_alloc) {
+        // The area commands point in the old buffer, start from scratch
+        line_alloc = len + 1 + 1024;
+        line_prev = xrealloc(line_prev, line_alloc);
+        line_buf = xrealloc(line_buf, line_alloc);
+        ckpt_count = 0;
+    }
+
+    for (unsigned i = ckpt_count; line_valid && i-- > 0; ) {
+        if (ckpts[i].offset <= same) {
+            ck = &ckpts[i];
+            ckpt_count = i;
+            break;
+        }
+    }
+    if (!ck)
+        ckpt_count = 0;
+
+    const size_t from = ck ? ck->offset : 0;
+
+    // The provider blocks past this point are found again
+    for (unsigned i = 0; i < provs.count; i++) {
+        if (provs.ptr[i].offset >= from)
+            provs.ptr[i].offset = SIZE_MAX;
+    }
+
+    memcpy(line_prev + from, text + from, len - from);
+    memcpy(line_buf + from, text + from, len - from);
+    line_prev[len] = line_buf[len] = '\0';
+    line_len = len;
+    line_valid = true;
+
+    p = line_buf + from;
+
+    if (ck) {
+        // Pick up where the previous line started to differ
+        fgc = ck->fgc;
+        bgc = ck->bgc;
+        ugc = ck->ugc;
+        attrs = ck->attrs;
+        font_index = ck->font_index;
+        cur_mon = ck->mon;
+        cur_block = ck->block;
+        pos_x = ck->pos_x;
+        align = ck->align;
+
+        // Reopen the areas closed past this point
+        area_stack.index = ck->area_index;
+        for (unsigned i = 0; i < area_stack.index; i++) {
+            if (area_stack.ptr[i].complete && area_stack.ptr[i].closed_at >= from)
+                area_stack.ptr[i].complete = false;
+        }
+
+        layout_copy_prefix(lay, prev_lay, ck);
+        lay->blocks[cur_block].width = pos_x;
+    } else {
+        pos_x = 0;
+        align = ALIGN_L;
+        cur_mon = monhead;
+
+        // Reset the default color set
+        bgc = dbgc;
+        fgc = dfgc;
+        ugc = dugc;
+        // Reset the default attributes and font selection
+        attrs = 0;
+        font_index = -1;
+
+        // Reset the stack position
+        area_stack.index = 0;
+
+        layout_reset(lay);
+        cur_block = layout_add_block(lay, cur_mon, align);
+    }
+
+    const unsigned first_new_seg = lay->seg_count;
+    run = NULL;
+
+    for (;;) {
+        if (*p == '\0' || *p == '\n')
+            break;
+
+        block_end = NULL;
+        if (p[0] == '%' && p[1] == '{') {
+            block_offset = p - line_buf;
+
+            // Once a formatting block is found unterminated a '}' appearing
+            // later on changes the meaning of what comes before, don't resume
+            // past this point.
+            if (!(block_end = strchr(p, '}')))
+                can_resume = false;
+
+            if (can_resume) {
+                if (ckpt_count == ckpt_alloc) {
+                    ckpt_alloc = ckpt_alloc ? ckpt_alloc * 2 : 32;
+                    ckpts = xreallocarray(ckpts, ckpt_alloc, sizeof(checkpoint_t));
+                }
+                ckpts[ckpt_count++] = (checkpoint_t){
+                    .offset = p - line_buf,
+                    .fgc = fgc, .bgc = bgc, .ugc = ugc,
+                    .attrs = attrs,
+                    .font_index = font_index,
+                    .mon = cur_mon,
+                    .block = cur_block,
+                    .pos_x = pos_x,
+                    .align = align,
+                    .area_index = area_stack.index,
+                    .block_count = lay->block_count,
+                    .seg_count = lay->seg_count,
+                    .glyph_count = lay->glyph_count,
+                };
+            }
+
+            // An unterminated block loses its '%', the rest is drawn as text
+            p++;
+        }
+
+        if (block_end) {
+            // Any formatting block terminates the current text run
+            run = NULL;
+
+            p++;
+            while (p < block_end) {
+                while (isspace(*p))
+                    p++;
+
+                switch (*p++) {
+                    // Enable/disable attributes.
+                    case '+': set_attribute('+', *p++); break;
+                    case '-': set_attribute('-', *p++); break;
+                    case '!': set_attribute('!', *p++); break;
+
+                    // Reverse foreground/background color.
+                    case 'R': {
+                        rgba_t tmp = fgc;
+                        fgc = bgc;
+                        bgc = tmp;
+                    } break;
+
+                    // Alignment specifiers.
+                    // Keep track of where we are and where we're moving to so
+                    // that underlines/overlines are correctly drawn over the
+                    // empty space.
+                    case 'l':
+                    case 'c':
+                    case 'r':
+                        align = (p[-1] == 'l') ? ALIGN_L : (p[-1] == 'c') ? ALIGN_C : ALIGN_R;
+                        cur_block = layout_align(cur_mon, cur_block, align);
+                        pos_x = 0;
+                        break;
+
+                    // Define input area.
+                    case 'A': {
+                        button = XCB_BUTTON_INDEX_1;
+                        // The range is 1-5
+                        if (isdigit(*p) && (*p > '0' && *p < '6'))
+                            button = *p++ - '0';
+                        if (!area_add(p, block_end, &p, cur_block, pos_x, button))
+                            goto done;
+                    } break;
+
+                    // Set background/foreground/underline color.
+                    case 'B': bgc = parse_color(p, &p, dbgc); break;
+                    case 'F': fgc = parse_color(p, &p, dfgc); break;
+                    case 'U': ugc = parse_color(p, &p, dugc); break;
+
+                    // Set current monitor used for drawing.
+                    case 'S': {
+                        monitor_t *orig_mon = cur_mon;
+
+                        cur_mon = monitor_select(cur_mon, &p, block_end);
+                        if (orig_mon != cur_mon) {
+                            pos_x = 0;
+                            align = ALIGN_L;
+                            cur_block = layout_add_block(lay, cur_mon, align);
+                        }
+                    } break;
+
+                    // Draw a N-pixel wide empty character.
+                    case 'O': {
+                        errno = 0;
+                        int w = (int) strtoul(p, &p, 10);
+                        if (errno)
+                            continue;
+
+                        seg_t *seg = layout_add_seg(lay, SEG_SPACE, cur_block, pos_x);
+                        seg->width = w;
+                        lay->blocks[cur_block].width += w;
+
+                        pos_x += w;
+                    } break;
+
+                    case 'T': {
+                          if (*p == '-') {
+                              // Switch to automatic font selection.
+                              font_index = -1;
+                              p++;
+                          } else if (isdigit(*p)) {
+                              font_index = (int)strtoul(p, &ep, 10);
+                              // User-specified 'font_index' ∊ (0,font_count]
+                              // Otherwise just fallback to the automatic font selection
+                              if (!font_index || font_index > font_count) {
+                                  fprintf(stderr, "Invalid font index %d\n", font_index);
+                                  font_index = -1;
+                              }
+                              p = ep;
+                          } else {
+                              // Swallow the invalid character and keep parsing.
+                              fprintf(stderr, "Invalid font slot \"%c\"\n", *p++);
+                          }
+                    } break;
+
+                    // Draw the text of a provider, the block is parsed again
+                    // starting from here when it changes.
+                    case 'P': {
+                        const int index = prov_get(p, block_end);
+                        p = block_end;
+                        if (index < 0)
+                            break;
+
+                        prov_t *prov = &provs.ptr[index];
+                        prov->offset = min(prov->offset, block_offset);
+                        prov_draw(prov, cur_block, &pos_x, &run);
+                    } break;
+
+                    // In case of error keep parsing after the closing }
+                    default:
+                        p = block_end;
+                }
+            }
+            // Eat the trailing }
+            p++;
+        } else {
+            // Escaped % symbol, eat the first one
+            if (p[0] == '%' && p[1] == '%')
+                p++;
+
+            // The text runs up to the next formatting block, decode it all
+            // at once
+            const size_t text_len = 1 + strcspn(p + 1, "%\n");
+
+            if (text_len > ucs_alloc) {
+                ucs_alloc = text_len;
+                ucs_buf = xreallocarray(ucs_buf, ucs_alloc, sizeof(uint32_t));
+            }
+
+            const size_t n = utf8_decode(p, text_len, ucs_buf);
+            p += text_len;
+
+            layout_add_text(ucs_buf, n, cur_block, &pos_x, &run);
+        }
+    }
+
+done:
+    layout_commit(first_new_seg);
+}
+
+op_t *
+op_add (op_list_t *l, const int type)
+{
+    if (l->count == l->alloc) {
+        l->alloc = l->alloc ? l->alloc * 2 : 16;
+        l->ptr = xreallocarray(l->ptr, l->alloc, sizeof(op_t));
+    }
+    l->ptr[l->count] = (op_t){ .type = type };
+
+    return &l->ptr[l->count++];
+}
+
+// Compile the template into a list of operations, the formatting is understood
+// the very same way parse() does. The %{$N} blocks are replaced by the Nth
+// field of every input line
+void
+tmpl_compile (const char *template)
+{
+    char *p, *block_end, *ep;
+
+    tmpl.src = xstrdup(template);
+    p = tmpl.src;
+
+    while (*p != '\0' && *p != '\n') {
+        block_end = NULL;
+        if (p[0] == '%' && p[1] == '{') {
+            // An unterminated block loses its '%' as in parse()
+            if (!(block_end = strchr(p, '}')))
+                p++;
+        }
+
+        if (block_end) {
+            p += 2;
+            while (p < block_end) {
+                while (isspace(*p))
+                    p++;
+
+                op_t *op;
+                switch (*p++) {
+                    case '+':
+                    case '-':
+                    case '!':
+                        if (*p != 'o' && *p != 'u') {
+                            fprintf(stderr, "Invalid attribute \"%c\" found\n", *p++);
+                            break;
+                        }
+                        op = op_add(&tmpl.ops, OP_ATTR);
+                        op->mod = p[-1];
+                        op->attr = *p++;
+                        break;
+
+                    case 'R': (void)op_add(&tmpl.ops, OP_SWAP); break;
+
+                    case 'l':
+                    case 'c':
+                    case 'r':
+                        op = op_add(&tmpl.ops, OP_ALIGN);
+                        op->arg = (p[-1] == 'l') ? ALIGN_L : (p[-1] == 'c') ? ALIGN_C : ALIGN_R;
+                        break;
+
+                    case 'A': {
+                        int button = XCB_BUTTON_INDEX_1;
+                        if (isdigit(*p) && (*p > '0' && *p < '6'))
+                            button = *p++ - '0';
+                        if (*p != ':') {
+                            (void)op_add(&tmpl.ops, OP_AREA_END);
+                            break;
+                        }
+                        // The area commands point in the template
+                        char *cmd = area_cmd(p, block_end, &p);
+                        if (!cmd) {
+                            fprintf(stderr, "Invalid command for the clickable area\n");
+                            p = block_end;
+                            break;
+                        }
+                        op = op_add(&tmpl.ops, OP_AREA);
+                        op->arg = button;
+                        op->str = cmd;
+                    } break;
+
+                    case 'B':
+                        op_add(&tmpl.ops, OP_BGC)->color = parse_color(p, &p, dbgc);
+                        break;
+                    case 'F':
+                        op_add(&tmpl.ops, OP_FGC)->color = parse_color(p, &p, dfgc);
+                        break;
+                    case 'U':
+                        op_add(&tmpl.ops, OP_UGC)->color = parse_color(p, &p, dugc);
+                        break;
+
+                    // The monitors may change, resolve the specifier later
+                    case 'S':
+                        if (*p == '\0' || !strchr("+-fln0123456789", *p)) {
+                            fprintf(stderr, "Unknown S specifier '%c'\n", *p++);
+                            break;
+                        }
+                        op = op_add(&tmpl.ops, OP_MONITOR);
+                        op->str = p;
+                        op->len = (*p == 'n') ? (size_t)(block_end - p) : 1;
+                        p += op->len;
+                        break;
+
+                    case 'O': {
+                        errno = 0;
+                        int w = (int) strtoul(p, &p, 10);
+                        if (errno)
+                            continue;
+                        op_add(&tmpl.ops, OP_OFFSET)->arg = w;
+                    } break;
+
+                    case 'T':
+                        if (*p == '-') {
+                            op_add(&tmpl.ops, OP_FONT)->arg = -1;
+                            p++;
+                        } else if (isdigit(*p)) {
+                            int index = (int)strtoul(p, &ep, 10);
+                            if (!index || index > font_count) {
+                                fprintf(stderr, "Invalid font index %d\n", index);
+                                index = -1;
+                            }
+                            op_add(&tmpl.ops, OP_FONT)->arg = index;
+                            p = ep;
+                        } else {
+                            fprintf(stderr, "Invalid font slot \"%c\"\n", *p++);
+                        }
+                        break;
+
+                    case '$': {
+                        const unsigned long slot = strtoul(p, &ep, 10);
+                        if (!isdigit(*p) || !slot || slot > 64) {
+                            fprintf(stderr, "Invalid template slot\n");
+                            p = block_end;
+                            break;
+                        }
+                        op_add(&tmpl.ops, OP_SLOT)->arg = slot - 1;
+                        tmpl.slot_count = max(tmpl.slot_count, slot);
+                        p = ep;
+                    } break;
+
+                    case 'P': {
+                        const int index = prov_get(p, block_end);
+                        p = block_end;
+                        if (index < 0)
+                            break;
+                        op_add(&tmpl.ops, OP_PROVIDER)->arg = index;
+                        provs.ptr[index].in_tmpl = true;
+                    } break;
+
+                    default:
+                        p = block_end;
+                }
+            }
+            // Eat the trailing }
+            p++;
+        } else {
+            // Escaped % symbol, eat the first one
+            if (p[0] == '%' && p[1] == '%')
+                p++;
+
+            const size_t text_len = 1 + strcspn(p + 1, "%\n");
+
+            op_t *op = op_add(&tmpl.ops, OP_TEXT);
+            op->ucs = xreallocarray(NULL, text_len, sizeof(uint32_t));
+            op->len = utf8_decode(p, text_len, op->ucs);
+            p += text_len;
+        }
+    }
+
+    tmpl.slots = xcalloc(max(tmpl.slot_count, 1), sizeof(slot_t));
+}
+
+// Lay out and draw a line given as a list of operations, the slots hold the
+// text of the OP_SLOT ones
+void
+ops_run (const op_list_t *ops, const slot_t *slots)
+{
+    monitor_t *cur_mon, *orig_mon;
+    unsigned cur_block;
+    seg_t *run, *seg;
+    int pos_x, align;
+    char *q;
+
+    pos_x = 0;
+    align = ALIGN_L;
+    cur_mon = monhead;
+
+    bgc = dbgc;
+    fgc = dfgc;
+    ugc = dugc;
+    attrs = 0;
+    font_index = -1;
+    area_stack.index = 0;
+
+    layout_reset(lay);
+    cur_block = layout_add_block(lay, cur_mon, align);
+    run = NULL;
+
+    for (unsigned i = 0; i < ops->count; i++) {
+        const op_t *op = &ops->ptr[i];
+
+        // Any formatting block terminates the current text run
+        if (op->type != OP_TEXT)
+            run = NULL;
+
+        switch (op->type) {
+            case OP_TEXT:
+                layout_add_text(op->ucs, op->len, cur_block, &pos_x, &run);
+                break;
+
+            case OP_SLOT: {
+                const slot_t *slot = &slots[op->arg];
+
+                if (slot->len > ucs_alloc) {
+                    ucs_alloc = slot->len;
+                    ucs_buf = xreallocarray(ucs_buf, ucs_alloc, sizeof(uint32_t));
+                }
+
+                const size_t n = utf8_decode(slot->str, slot->len, ucs_buf);
+                layout_add_text(ucs_buf, n, cur_block, &pos_x, &run);
+            } break;
+
+            case OP_ATTR: set_attribute(op->mod, op->attr); break;
+
+            case OP_SWAP: {
+                rgba_t tmp = fgc;
+                fgc = bgc;
+                bgc = tmp;
+            } break;
+
+            case OP_ALIGN:
+                align = op->arg;
+                cur_block = layout_align(cur_mon, cur_block, align);
+                pos_x = 0;
+                break;
+
+            case OP_AREA: area_open(op->str, cur_block, pos_x, op->arg); break;
+            case OP_AREA_END:
+                if (!area_close(cur_block, pos_x))
+                    goto done;
+                break;
+
+            case OP_BGC: bgc = op->color; break;
+            case OP_FGC: fgc = op->color; break;
+            case OP_UGC: ugc = op->color; break;
+
+            case OP_MONITOR:
+                orig_mon = cur_mon;
+                if (op->str) {
+                    q = op->str;
+                    cur_mon = monitor_select(cur_mon, &q, op->str + op->len);
+                } else {
+                    cur_mon = monhead;
+                    for (int n = 0; n != op->arg && cur_mon->next; n++)
+                        cur_mon = cur_mon->next;
+                }
+                if (orig_mon != cur_mon) {
+                    pos_x = 0;
+                    align = ALIGN_L;
+                    cur_block = layout_add_block(lay, cur_mon, align);
+                }
+                break;
+
+            case OP_OFFSET:
+                seg = layout_add_seg(lay, SEG_SPACE, cur_block, pos_x);
+                seg->width = op->arg;
+                lay->blocks[cur_block].width += op->arg;
+                pos_x += op->arg;
+                break;
+
+            case OP_FONT: font_index = op->arg; break;
+
+            case OP_PROVIDER: prov_draw(&provs.ptr[op->arg], cur_block, &pos_x, &run); break;
+        }
+    }
+
+done:
+    layout_commit(0);
+}
+
+// Draw the template filling the slots with the fields of the line, the
+// formatting in the fields is drawn as it is
+void
+tmpl_run (const char *line)
+{
+    const size_t len = strcspn(line, "\n");
+
+    // Nothing to do if neither the line nor the providers changed
+    if (tmpl.valid && provs.dirty_from == SIZE_MAX &&
+            len == tmpl.line_len && !memcmp(line, tmpl.line, len))
+        return;
+    provs.dirty_from = SIZE_MAX;
+
+    if (len + 1 > tmpl.line_alloc) {
+        tmpl.line_alloc = len + 1;
+        tmpl.line = xrealloc(tmpl.line, tmpl.line_alloc);
+    }
+    memcpy(tmpl.line, line, len);
+    tmpl.line[len] = '\0';
+    tmpl.line_len = len;
+    tmpl.valid = true;
+
+    // Split the fields, the missing ones are left empty
+    const char *field = tmpl.line;
+    for (unsigned i = 0; i < tmpl.slot_count; i++) {
+        const char *end = strchrnul(field, tmpl.delim);
+
+        tmpl.slots[i] = (slot_t){ .str = field, .len = end - field };
+        field = *end ? end + 1 : end;
+    }
+
+    ops_run(&tmpl.ops, tmpl.slots);
+}
+
+// Decode a binary frame, made of records starting with a type byte followed by
+// their arguments in host byte order. Returns false if the frame is malformed
+bool
+bin_decode (bin_frame_t *f, const uint8_t *p, const size_t len)
+{
+    const uint8_t *end = p + len;
+    size_t ucs_len = 0, strs_len = 0;
+    uint32_t v;
+    op_t *op;
+
+    // Neither the text nor the commands can be longer than the frame, the
+    // operations point in these buffers
+    if (len / 4 + 1 > f->ucs_alloc) {
+        f->ucs_alloc = len / 4 + 1;
+        f->ucs = xreallocarray(f->ucs, f->ucs_alloc, sizeof(uint32_t));
+    }
+    if (len + 1 > f->strs_alloc) {
+        f->strs_alloc = len + 1;
+        f->strs = xrealloc(f->strs, f->strs_alloc);
+    }
+    f->ops.count = 0;
+
+#define NEED(n) if ((size_t)(end - p) < (size_t)(n)) return false
+#define TAKE_U32(x) do { NEED(4); memcpy(&(x), p, 4); p += 4; } while (0)
+
+    while (p < end) {
+        const uint8_t type = *p++;
+
+        switch (type) {
+            // Set the background/foreground/underline color in ARGB format
+            case 'B':
+            case 'F':
+            case 'U':
+                TAKE_U32(v);
+                op = op_add(&f->ops, type == 'B' ? OP_BGC : type == 'F' ? OP_FGC : OP_UGC);
+                op->color = color_premultiply((rgba_t)v);
+                break;
+
+            // Reset the given color to the default one
+            case 'D':
+                NEED(1);
+                switch (*p++) {
+                    case 'B': op_add(&f->ops, OP_BGC)->color = dbgc; break;
+                    case 'F': op_add(&f->ops, OP_FGC)->color = dfgc; break;
+                    case 'U': op_add(&f->ops, OP_UGC)->color = dugc; break;
+                    default: return false;
+                }
+                break;
+
+            case 'R': (void)op_add(&f->ops, OP_SWAP); break;
+
+            case '+':
+            case '-':
+            case '!':
+                NEED(1);
+                if (*p != 'o' && *p != 'u')
+                    return false;
+                op = op_add(&f->ops, OP_ATTR);
+                op->mod = type;
+                op->attr = *p++;
+                break;
+
+            case 'l':
+            case 'c':
+            case 'r':
+                op = op_add(&f->ops, OP_ALIGN);
+                op->arg = (type == 'l') ? ALIGN_L : (type == 'c') ? ALIGN_C : ALIGN_R;
+                break;
+
+            // Switch to the Nth monitor
+            case 'S':
+                TAKE_U32(v);
+                op_add(&f->ops, OP_MONITOR)->arg = (int)min(v, INT_MAX);
+                break;
+
+            case 'O':
+                TAKE_U32(v);
+                op_add(&f->ops, OP_OFFSET)->arg = (int32_t)v;
+                break;
+
+            // Select the font by its 1-based index, 0 for the automatic selection
+            case 'T':
+                TAKE_U32(v);
+                op_add(&f->ops, OP_FONT)->arg = (v && v <= (uint32_t)font_count) ? (int)v : -1;
+                break;
+
+            // Open an area, the button is followed by the length of the command
+            case 'A': {
+                NEED(1);
+                const uint8_t button = *p++;
+                TAKE_U32(v);
+                NEED(v);
+                if (button < 1 || button > 5 || !v || memchr(p, '\0', v))
+                    return false;
+
+                op = op_add(&f->ops, OP_AREA);
+                op->arg = button;
+                op->str = f->strs + strs_len;
+                memcpy(op->str, p, v);
+                op->str[v] = '\0';
+                strs_len += v + 1;
+                p += v;
+            } break;
+
+            case 'a': (void)op_add(&f->ops, OP_AREA_END); break;
+
+            // A run of UTF-32 codepoints preceded by their count
+            case 'X':
+                TAKE_U32(v);
+                if (v > (size_t)(end - p) / 4)
+                    return false;
+
+                op = op_add(&f->ops, OP_TEXT);
+                op->ucs = f->ucs + ucs_len;
+                op->len = v;
+                memcpy(op->ucs, p, v * 4);
+                for (uint32_t i = 0; i < v; i++) {
+                    if (op->ucs[i] > 0x10ffff)
+                        return false;
+                }
+                ucs_len += v;
+                p += v * 4;
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+#undef TAKE_U32
+#undef NEED
+
+    return true;
+}
+
+// Draw the frame unless it's the very same as the one being displayed
+void
+bin_run (const char *frame, const size_t len)
+{
+    if (bin.valid && len == bin.frame_len && !memcmp(frame, bin.frame, len))
+        return;
+
+    if (!bin_decode(&bin.next, (const uint8_t *)frame, len)) {
+        fprintf(stderr, "Dropping a malformed input frame\n");
+        input.dropped++;
+        return;
+    }
+
+    const bin_frame_t tmp = bin.cur;
+    bin.cur = bin.next;
+    bin.next = tmp;
+
+    if (len > bin.frame_alloc) {
+        bin.frame_alloc = len;
+        bin.frame = xrealloc(bin.frame, bin.frame_alloc);
+    }
+    memcpy(bin.frame, frame, len);
+    bin.frame_len = len;
+    bin.valid = true;
+
+    ops_run(&bin.cur.ops, NULL);
+}
+
+void
+font_list_add (font_t *font)
+{
+    if (font_count == FONT_MAX) {
+        fprintf(stderr, "Too many fonts, at most %d can be loaded\n", FONT_MAX);
+        exit(EXIT_FAILURE);
+    }
+
+    // The fallback order changed
+    font_map_reset();
+
+    font_list = xreallocarray(font_list, font_count + 1, sizeof(font_t));
+    if (!font_list) {
+        fprintf(stderr, "Failed to allocate %d font descriptors", font_count + 1);
+        exit(EXIT_FAILURE);
+    }
+    font_list[font_count++] = font;
+}
+
+#if WITH_RENDER
+// Find the picture formats used for the glyphs and for the bar window.
+bool
+render_init (void)
+{
+    const xcb_query_extension_reply_t *qe_reply;
+    xcb_render_query_pict_formats_reply_t *fmt_reply;
+
+    if (ft_lib)
+        return true;
+
+    qe_reply = xcb_get_extension_data(c, &xcb_render_id);
+    if (!qe_reply || !qe_reply->present) {
+        fprintf(stderr, "The RENDER extension is not available\n");
+        return false;
+    }
+
+    fmt_reply = xcb_render_query_pict_formats_reply(c, xcb_render_query_pict_formats(c), NULL);
+    if (!fmt_reply)
+        return false;
+
+    xcb_render_pictforminfo_iterator_t fi = xcb_render_query_pict_formats_formats_iterator(fmt_reply);
+    for (; fi.rem; xcb_render_pictforminfo_next(&fi)) {
+        const xcb_render_pictforminfo_t *f = fi.data;
+
+        if (f->type == XCB_RENDER_PICT_TYPE_DIRECT && f->depth == 8 &&
+                f->direct.alpha_mask == 0xff && f->direct.alpha_shift == 0)
+            fmt_a8 = f->id;
+    }
+
+    xcb_render_pictscreen_iterator_t si = xcb_render_query_pict_formats_screens_iterator(fmt_reply);
+    for (; si.rem; xcb_render_pictscreen_next(&si)) {
+        xcb_render_pictdepth_iterator_t di = xcb_render_pictscreen_depths_iterator(si.data);
+        for (; di.rem; xcb_render_pictdepth_next(&di)) {
+            xcb_render_pictvisual_iterator_t vi = xcb_render_pictdepth_visuals_iterator(di.data);
+            for (; vi.rem; xcb_render_pictvisual_next(&vi)) {
+                if (vi.data->visual == visual)
+                    fmt_visual = vi.data->format;
+            }
+        }
+    }
+
+    free(fmt_reply);
+
+    if (!fmt_a8 || !fmt_visual) {
+        fprintf(stderr, "Couldn't find the picture formats\n");
+        return false;
+    }
+
+    if (!FcInit() || FT_Init_FreeType(&ft_lib)) {
+        fprintf(stderr, "Couldn't initialize FreeType\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Load an outline font matching the fontconfig pattern.
+bool
+font_load_render (font_t *font)
+{
+    const char *pattern = font->pattern + 4;
+    FcPattern *pat, *match;
+    FcResult result;
+    FcChar8 *file;
+    int index = 0;
+    double size = 0;
+    FT_Face face;
+
+    if (!render_init())
+        return false;
+
+    pat = FcNameParse((const FcChar8 *)pattern);
+    if (!pat) {
+        fprintf(stderr, "Could not parse font \"%s\"\n", pattern);
+        return false;
+    }
+
+    FcConfigSubstitute(NULL, pat, FcMatchPattern);
+    FcDefaultSubstitute(pat);
+    match = FcFontMatch(NULL, pat, &result);
+    FcPatternDestroy(pat);
+
+    if (!match || FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch) {
+        fprintf(stderr, "Could not load font \"%s\"\n", pattern);
+        if (match)
+            FcPatternDestroy(match);
+        return false;
+    }
+
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &size);
+
+    if (FT_New_Face(ft_lib, (const char *)file, index, &face)) {
+        fprintf(stderr, "Could not load font \"%s\"\n", pattern);
+        FcPatternDestroy(match);
+        return false;
+    }
+
+    FcPatternDestroy(match);
+
+    if (FT_Set_Pixel_Sizes(face, 0, size > 0 ? (FT_UInt)(size + 0.5) : 12)) {
+        fprintf(stderr, "Could not set the size of font \"%s\"\n", pattern);
+        FT_Done_Face(face);
+        return false;
+    }
+
+    const FT_Size_Metrics *m = &face->size->metrics;
+
+    font->ptr = XCB_NONE;
+    font->face = face;
+    font->descent = -(m->descender >> 6);
+    font->height = (m->ascender >> 6) + font->descent;
+    font->width = (m->max_advance + 63) >> 6;
+    font->char_min = 0;
+    font->char_max = 0xffff;
+
+    font->glyphset = xcb_generate_id(c);
+    xcb_render_create_glyph_set(c, font->glyphset, fmt_a8);
+
+    return true;
+}
+#endif
+
+// Only remember the font name, the fonts are loaded by font_setup once the
+// command line has been parsed.
+void
+font_load (const char *pattern)
+{
+    font_t *ret = xcalloc(1, sizeof(font_t));
+
+    ret->pattern = xstrdup(pattern);
+
+    font_list_add(ret);
+}
+
+bool
+font_is_outline (const font_t *font)
+{
+    return !strncmp(font->pattern, "xft:", 4);
+}
+
+// Collect the height and the character range of a font that's opened on
+// demand, the last reply in the series carries no name.
+bool
+font_info_reply (font_t *font, xcb_list_fonts_with_info_cookie_t cookie)
+{
+    xcb_list_fonts_with_info_reply_t *info;
+    bool found = false;
+
+    while ((info = xcb_list_fonts_with_info_reply(c, cookie, NULL))) {
+        const bool last = info->name_len == 0;
+
+        if (!last && !found) {
+            font->descent = info->font_descent;
+            font->height = info->font_ascent + info->font_descent;
+            font->char_max = info->max_byte1 << 8 | info->max_char_or_byte2;
+            font->char_min = info->min_byte1 << 8 | info->min_char_or_byte2;
+            found = true;
+        }
+
+        free(info);
+        if (last)
+            break;
+    }
+
+    if (!found)
+        fprintf(stderr, "Could not load font \"%s\"\n", font->pattern);
+
+    return found;
+}
+
+// Open the first font and fetch the metrics of the other ones, which are
+// opened the first time they're needed. ListFontsWithInfo doesn't carry the
+// per-character metrics and is way cheaper than opening and querying the
+// font. All the requests are sent at once before waiting for any reply, the
+// font path is needed to look up the metrics cache.
+void
+font_setup (void)
+{
+    xcb_void_cookie_t open_cookie = { 0 };
+    xcb_list_fonts_with_info_cookie_t info_cookies[max(font_count, 1)];
+
+    if (font_count && !font_is_outline(font_list[0])) {
+        font_list[0]->ptr = xcb_generate_id(c);
+        open_cookie = xcb_open_font_checked(c, font_list[0]->ptr,
+                strlen(font_list[0]->pattern), font_list[0]->pattern);
+    }
+
+    const xcb_get_font_path_cookie_t path_cookie = xcb_get_font_path(c);
+
+    for (int i = 1; i < font_count; i++) {
+        font_t *font = font_list[i];
+
+        if (!font_is_outline(font)) {
+            font->pending = true;
+            info_cookies[i] = xcb_list_fonts_with_info(c, 1, strlen(font->pattern), font->pattern);
+        }
+    }
+
+    xcb_get_font_path_reply_t *path_reply = xcb_get_font_path_reply(c, path_cookie, NULL);
+
+    if (path_reply && !font_path) {
+        xcb_str_iterator_t it = xcb_get_font_path_path_iterator(path_reply);
+        size_t len = 0;
+
+        font_path = xcalloc(1, xcb_get_font_path_sizeof(path_reply));
+        for (; it.rem; xcb_str_next(&it)) {
+            memcpy(font_path + len, xcb_str_name(it.data), xcb_str_name_length(it.data));
+            len += xcb_str_name_length(it.data);
+            font_path[len++] = ',';
+        }
+    }
+
+    free(path_reply);
+
+    int j = 0;
+
+    for (int i = 0; i < font_count; i++) {
+        font_t *font = font_list[i];
+        bool ok = false;
+
+        if (font_is_outline(font)) {
+#if WITH_RENDER
+            ok = font_load_render(font);
+#else
+            fprintf(stderr, "Could not load font \"%s\", lemonbar was built without WITH_RENDER\n", font->pattern);
+#endif
+        } else if (i == 0) {
+            ok = font_open_reply(font, open_cookie, font_cache_load(font));
+        } else {
+            ok = font_info_reply(font, info_cookies[i]);
+        }
+
+        if (!ok) {
+            free(font->pattern);
+            free(font);
+            continue;
+        }
+
+        font_list[j++] = font;
+    }
+
+    font_count = j;
+    font_map_reset();
+}
+
+enum {
+    NET_WM_WINDOW_TYPE,
+    NET_WM_WINDOW_TYPE_DOCK,
+    NET_WM_DESKTOP,
+    NET_WM_STRUT_PARTIAL,
+    NET_WM_STRUT,
+    NET_WM_STATE,
+    NET_WM_STATE_STICKY,
+    NET_WM_STATE_ABOVE,
+};
+
+static xcb_atom_t ewmh_atoms[NET_WM_STATE_ABOVE + 1];
+static bool ewmh_ready = false;
+
+void
+set_ewmh_strut (monitor_t *mon)
+{
+    int strut[12] = {0};
+
+    if (!ewmh_ready)
+        return;
+
+    if (topbar) {
+        strut[2] = bh;
+        strut[8] = mon->x;
+        strut[9] = mon->x + mon->width - 1;
+    } else {
+        strut[3]  = bh;
+        strut[10] = mon->x;
+        strut[11] = mon->x + mon->width - 1;
+    }
+
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, ewmh_atoms[NET_WM_STRUT_PARTIAL], XCB_ATOM_CARDINAL, 32, 12, strut);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, ewmh_atoms[NET_WM_STRUT], XCB_ATOM_CARDINAL, 32, 4, strut);
+}
+
+void
+set_ewmh_props (monitor_t *mon)
+{
+    if (!ewmh_ready)
+        return;
+
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, ewmh_atoms[NET_WM_WINDOW_TYPE], XCB_ATOM_ATOM, 32, 1, &ewmh_atoms[NET_WM_WINDOW_TYPE_DOCK]);
+    xcb_change_property(c, XCB_PROP_MODE_APPEND,  mon->window, ewmh_atoms[NET_WM_STATE], XCB_ATOM_ATOM, 32, 2, &ewmh_atoms[NET_WM_STATE_STICKY]);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, ewmh_atoms[NET_WM_DESKTOP], XCB_ATOM_CARDINAL, 32, 1, (const uint32_t []){ -1 } );
+    set_ewmh_strut(mon);
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, 3, "bar");
+    xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, 12, "lemonbar\0Bar");
+}
+
+void
+set_ewmh_atoms (void)
+{
+    const char *atom_names[] = {
+        "_NET_WM_WINDOW_TYPE",
+        "_NET_WM_WINDOW_TYPE_DOCK",
+        "_NET_WM_DESKTOP",
+        "_NET_WM_STRUT_PARTIAL",
+        "_NET_WM_STRUT",
+        "_NET_WM_STATE",
+        // Leave those at the end since are batch-set
+        "_NET_WM_STATE_STICKY",
+        "_NET_WM_STATE_ABOVE",
+    };
+    const int atoms = sizeof(atom_names)/sizeof(char *);
+    xcb_intern_atom_cookie_t atom_cookie[atoms];
+    xcb_intern_atom_reply_t *atom_reply;
+
+    // As suggested fetch all the cookies first (yum!) and then retrieve the
+    // atoms to exploit the async'ness
+    for (int i = 0; i < atoms; i++)
+        atom_cookie[i] = xcb_intern_atom(c, 0, strlen(atom_names[i]), atom_names[i]);
+
+    for (int i = 0; i < atoms; i++) {
+        atom_reply = xcb_intern_atom_reply(c, atom_cookie[i], NULL);
+        if (!atom_reply)
+            return;
+        ewmh_atoms[i] = atom_reply->atom;
+        free(atom_reply);
+    }
+
+    ewmh_ready = true;
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        set_ewmh_props(mon);
+}
+
+monitor_t *
+monitor_new (int x, int y, int width, int height, char *name)
+{
+    monitor_t *ret;
+
+    ret = xcalloc(1, sizeof(monitor_t));
+    ret->name = name;
+    ret->x = x;
+    ret->y = (topbar ? by : height - bh - by) + y;
+    ret->width = width;
+    ret->height = height;
+    ret->next = ret->prev = NULL;
+    ret->window = xcb_generate_id(c);
+
+    int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
+    xcb_create_window(c, depth, ret->window, scr->root,
+            ret->x, ret->y, width, bh, 0,
+            XCB_WINDOW_CLASS_INPUT_OUTPUT, visual,
+            XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP,
+            (const uint32_t []){ bgc.v, bgc.v, dock, XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_BUTTON_PRESS, colormap });
+
+    ret->pixmap = xcb_generate_id(c);
+    xcb_create_pixmap(c, depth, ret->pixmap, ret->window, width, bh);
+
+    if (client_render)
+        image_create(ret);
+
+    return ret;
+}
+
+void
+monitor_add (monitor_t *mon)
+{
+    if (!monhead) {
+        monhead = mon;
+    } else if (!montail) {
+        montail = mon;
+        monhead->next = mon;
+        mon->prev = monhead;
+    } else {
+        mon->prev = montail;
+        montail->next = mon;
+        montail = montail->next;
+    }
+}
+
+// Pick the monitor with the same name out of the previous configuration,
+// moving and resizing its window as needed, or create a new one.
+monitor_t *
+monitor_reuse (int x, int y, int width, int height, char *name)
+{
+    monitor_t *mon = mon_stale;
+
+    while (mon && !(name && mon->name && !strcmp(name, mon->name)))
+        mon = mon->next;
+
+    if (!mon)
+        return monitor_new(x, y, width, height, name);
+
+    if (mon->prev)
+        mon->prev->next = mon->next;
+    else
+        mon_stale = mon->next;
+    if (mon->next)
+        mon->next->prev = mon->prev;
+    mon->prev = mon->next = NULL;
+    free(name);
+
+    y = (topbar ? by : height - bh - by) + y;
+
+    if (x == mon->x && y == mon->y && width == mon->width) {
+        mon->height = height;
+        return mon;
+    }
+
+    if (width != mon->width) {
+        int depth = (visual == scr->root_visual) ? XCB_COPY_FROM_PARENT : 32;
+
+        xcb_free_pixmap(c, mon->pixmap);
+        xcb_create_pixmap(c, depth, mon->pixmap, mon->window, width, bh);
+        mon->dirty_count = 0;
+
+        if (client_render) {
+            image_destroy(mon);
+            mon->width = width;
+            image_create(mon);
+        }
+    }
+
+    mon->x = x;
+    mon->y = y;
+    mon->width = width;
+    mon->height = height;
+
+    xcb_configure_window(c, mon->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH,
+            (const uint32_t []){ mon->x, mon->y, mon->width });
+    set_ewmh_strut(mon);
+
+    return mon;
+}
+
+// Clear the pixmap and map the window of a new monitor
+void
+monitor_show (monitor_t *mon)
+{
+    fill_rect(mon->pixmap, gc_get(dbgc, NULL), 0, 0, mon->width, bh);
+    xcb_map_window(c, mon->window);
+
+    // Make sure that the window really gets in the place it's supposed to be
+    // Some WM such as Openbox need this
+    xcb_configure_window(c, mon->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_STACK_MODE, (const uint32_t []){ mon->x, mon->y, XCB_STACK_MODE_BELOW });
+
+    // Set the WM_NAME atom to the user specified value
+    if (wm_name)
+        xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8 ,strlen(wm_name), wm_name);
+}
+
+void
+monitor_free (monitor_t *mon)
+{
+    xcb_destroy_window(c, mon->window);
+    if (!mon->mirror)
+        xcb_free_pixmap(c, mon->pixmap);
+    free(mon->name);
+    free(mon->dirty);
+    image_destroy(mon);
+    free(mon);
+}
+
+int
+mon_sort_cb (const void *p1, const void *p2)
+{
+    const monitor_t *m1 = (monitor_t *)p1;
+    const monitor_t *m2 = (monitor_t *)p2;
+
+    if (m1->x < m2->x || m1->y + m1->height <= m2->y)
+        return -1;
+    if (m1->x > m2->x || m1->y + m1->height > m2->y)
+        return  1;
+
+    return 0;
+}
+
+void
+monitor_create_chain (monitor_t *mons, const int num)
+{
+    int i;
+    int width = 0, height = 0;
+    int left = bx;
+
+    // Sort before use, but only if specific outputs were not specified on command line
+    if (!num_outputs)
+        qsort(mons, num, sizeof(monitor_t), mon_sort_cb);
+
+    for (i = 0; i < num; i++) {
+        int h = mons[i].y + mons[i].height;
+        // Accumulated width of all monitors
+        width += mons[i].width;
+        // Get height of screen from y_offset + height of lowest monitor
+        if (h >= height)
+        height = h;
+    }
+
+    if (bw < 0)
+        bw = width - bx;
+
+    // Use the first font height as all the font heights have been set to the biggest of the set.
+    // The height is settled once the bar is up, the windows, the pixmaps and
+    // the cached text are sized after it: a screen too short for it is refused
+    // by the check below when reconfiguring.
+    if (!mon_stale && (bh < 0 || bh > height))
+        bh = font_list[0]->height + bu + 2;
+
+    // Check the geometry
+    if (bx + bw > width || by + bh > height) {
+        fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
+        // Keep the current monitors if the screen has been reconfigured
+        if (randr_base)
+            return;
+        exit(EXIT_FAILURE);
+    }
+
+    // Left is a positive number or zero therefore monitors with zero width are excluded
+    width = bw;
+    for (i = 0; i < num; i++) {
+        if (mons[i].y + mons[i].height < by)
+            continue;
+        if (mons[i].width > left) {
+            monitor_t *mon = monitor_reuse(
+                    mons[i].x + left,
+                    mons[i].y,
+                    min(width, mons[i].width - left),
+                    mons[i].height,
+                    mons[i].name? xstrdup(mons[i].name) : NULL);
+
+            if (!mon)
+                break;
+
+            monitor_add(mon);
+
+            width -= mons[i].width - left;
+
+            // No need to check for other monitors
+            if (width <= 0)
+                break;
+        }
+
+        left -= mons[i].width;
+
+        if (left < 0)
+            left = 0;
+    }
+}
+
+// Whether the output has been selected with -o, every output is when none was
+bool
+output_wanted (const char *name, const int len)
+{
+    if (!num_outputs)
+        return true;
+
+    for (int i = 0; i < num_outputs; i++) {
+        if (strlen(output_names[i]) == (size_t)len && !memcmp(output_names[i], name, len))
+            return true;
+    }
+
+    return false;
+}
+
+int
+clone_sort_cb (const void *p1, const void *p2)
+{
+    const monitor_t *m1 = *(monitor_t **)p1;
+    const monitor_t *m2 = *(monitor_t **)p2;
+
+    if (m1->x != m2->x)
+        return m1->x - m2->x;
+    if (m1->x + m1->width != m2->x + m2->width)
+        return (m2->x + m2->width) - (m1->x + m1->width);
+    if (m1->width * m1->height != m2->width * m2->height)
+        return m2->width * m2->height - m1->width * m1->height;
+
+    // Keep the first one out of a set of identical monitors
+    return (m1 > m2) - (m1 < m2);
+}
+
+// Drop the monitors that are clones of, or are contained in, another one and
+// return how many were dropped. The monitors are swept from left to right, a
+// monitor can only be contained in one starting before it and whose right
+// edge hasn't been left behind yet, so only those are kept around.
+int
+monitors_drop_clones (monitor_t *mons, const int num)
+{
+    monitor_t *order[num], *active[num];
+    int count = 0, active_count = 0, dropped = 0;
+
+    for (int i = 0; i < num; i++) {
+        if (mons[i].width)
+            order[count++] = &mons[i];
+    }
+
+    qsort(order, count, sizeof(monitor_t *), clone_sort_cb);
+
+    for (int i = 0; i < count; i++) {
+        monitor_t *m = order[i];
+        bool contained = false;
+        int k = 0;
+
+        for (int j = 0; j < active_count; j++) {
+            const monitor_t *a = active[j];
+
+            if (a->x + a->width <= m->x)
+                continue;
+            active[k++] = active[j];
+
+            if (m->x + m->width <= a->x + a->width &&
+                m->y >= a->y && m->y + m->height <= a->y + a->height)
+                contained = true;
+        }
+        active_count = k;
+
+        if (contained) {
+            m->width = 0;
+            dropped++;
+        } else {
+            active[active_count++] = m;
+        }
+    }
+
+    return dropped;
+}
+
+// Collect the logical monitors out of the RandR 1.5 GetMonitors reply, their
+// names are atoms that are resolved all at once.
+monitor_t *
+randr_monitors_logical (xcb_randr_get_monitors_reply_t *gm_reply, int *num)
+{
+    xcb_randr_monitor_info_iterator_t iter;
+    monitor_t *mons;
+
+    *num = xcb_randr_get_monitors_monitors_length(gm_reply);
+    if (*num < 1)
+        return NULL;
+
+    xcb_get_atom_name_cookie_t cookies[*num];
+    mons = xcalloc(*num, sizeof(monitor_t));
+
+    iter = xcb_randr_get_monitors_monitors_iterator(gm_reply);
+    for (int i = 0; iter.rem; i++, xcb_randr_monitor_info_next(&iter)) {
+        const xcb_randr_monitor_info_t *mi = iter.data;
+
+        mons[i] = (monitor_t){ .x = mi->x, .y = mi->y, .width = mi->width, .height = mi->height };
+        cookies[i] = xcb_get_atom_name(c, mi->name);
+    }
+
+    for (int i = 0; i < *num; i++) {
+        xcb_get_atom_name_reply_t *an_reply = xcb_get_atom_name_reply(c, cookies[i], NULL);
+
+        if (!an_reply || !output_wanted(xcb_get_atom_name_name(an_reply),
+                    xcb_get_atom_name_name_length(an_reply))) {
+            mons[i].width = 0;
+            free(an_reply);
+            continue;
+        }
+
+        mons[i].name = xcalloc(xcb_get_atom_name_name_length(an_reply) + 1, 1);
+        memcpy(mons[i].name, xcb_get_atom_name_name(an_reply), xcb_get_atom_name_name_length(an_reply));
+
+        free(an_reply);
+    }
+
+    return mons;
+}
+
+// Collect the outputs and the CRTCs driving them on servers older than
+// RandR 1.5, the requests for every output are sent at once and so are the
+// ones for every CRTC.
+monitor_t *
+randr_monitors_outputs (int *num)
+{
+    xcb_randr_get_screen_resources_current_reply_t *rres_reply;
+    xcb_randr_output_t *outputs;
+    monitor_t *mons;
+    bool failed = false;
+
+    rres_reply = xcb_randr_get_screen_resources_current_reply(c,
+            xcb_randr_get_screen_resources_current(c, scr->root), NULL);
+
+    if (!rres_reply) {
+        fprintf(stderr, "Failed to get current randr screen resources\n");
+        return NULL;
+    }
+
+    *num = xcb_randr_get_screen_resources_current_outputs_length(rres_reply);
+    outputs = xcb_randr_get_screen_resources_current_outputs(rres_reply);
+
+    // There should be at least one output
+    if (*num < 1) {
+        free(rres_reply);
+        return NULL;
+    }
+
+    xcb_randr_get_output_info_cookie_t oi_cookies[*num];
+    xcb_randr_get_output_info_reply_t *oi_replies[*num];
+    xcb_randr_get_crtc_info_cookie_t ci_cookies[*num];
+
+    for (int i = 0; i < *num; i++)
+        oi_cookies[i] = xcb_randr_get_output_info(c, outputs[i], XCB_CURRENT_TIME);
+
+    free(rres_reply);
+
+    for (int i = 0; i < *num; i++) {
+        oi_replies[i] = xcb_randr_get_output_info_reply(c, oi_cookies[i], NULL);
+
+        // Output disconnected or not attached to any CRTC ?
+        if (!oi_replies[i] || oi_replies[i]->crtc == XCB_NONE ||
+                oi_replies[i]->connection != XCB_RANDR_CONNECTION_CONNECTED) {
+            free(oi_replies[i]);
+            oi_replies[i] = NULL;
+            continue;
+        }
+
+        ci_cookies[i] = xcb_randr_get_crtc_info(c, oi_replies[i]->crtc, XCB_CURRENT_TIME);
+    }
+
+    // Every entry starts with a size of 0, making it invalid until we fill in
+    // the data retrieved from the Xserver.
+    mons = xcalloc(*num, sizeof(monitor_t));
+
+    for (int i = 0; i < *num; i++) {
+        xcb_randr_get_crtc_info_reply_t *ci_reply;
+
+        if (!oi_replies[i])
+            continue;
+
+        ci_reply = xcb_randr_get_crtc_info_reply(c, ci_cookies[i], NULL);
+
+        if (!ci_reply)
+            failed = true;
+
+        const int name_len = xcb_randr_get_output_info_name_length(oi_replies[i]);
+        const char *name_ptr = (char *)xcb_randr_get_output_info_name(oi_replies[i]);
+
+        if (ci_reply && output_wanted(name_ptr, name_len)) {
+            char *alloc_name = xcalloc(name_len + 1, 1);
+            memcpy(alloc_name, name_ptr, name_len);
+
+            // There's no need to handle rotated screens here (see #69)
+            mons[i] = (monitor_t){ .name = alloc_name, .x = ci_reply->x, .y = ci_reply->y,
+                .width = ci_reply->width, .height = ci_reply->height };
+        }
+
+        free(oi_replies[i]);
+        free(ci_reply);
+    }
+
+    if (failed) {
+        fprintf(stderr, "Failed to get RandR crtc info\n");
+        for (int i = 0; i < *num; i++)
+            free(mons[i].name);
+        free(mons);
+        return NULL;
+    }
+
+    return mons;
+}
+
+void
+get_randr_monitors (void)
+{
+    xcb_randr_query_version_reply_t *qv_reply;
+    xcb_randr_get_monitors_reply_t *gm_reply = NULL;
+    monitor_t *mons;
+    int i, j, num, valid = 0;
+
+    // Ask for the logical monitors right away, the reply is thrown away if
+    // the server turns out to be older than RandR 1.5
+    const xcb_randr_query_version_cookie_t qv_cookie = xcb_randr_query_version(c, 1, 5);
+    const xcb_randr_get_monitors_cookie_t gm_cookie = xcb_randr_get_monitors(c, scr->root, 1);
+
+    qv_reply = xcb_randr_query_version_reply(c, qv_cookie, NULL);
+
+    if (qv_reply && (qv_reply->major_version > 1 || qv_reply->minor_version >= 5))
+        gm_reply = xcb_randr_get_monitors_reply(c, gm_cookie, NULL);
+    else
+        xcb_discard_reply(c, gm_cookie.sequence);
+
+    free(qv_reply);
+
+    if (gm_reply) {
+        mons = randr_monitors_logical(gm_reply, &num);
+        free(gm_reply);
+    } else {
+        mons = randr_monitors_outputs(&num);
+    }
+
+    if (!mons)
+        return;
+
+    for (i = 0; i < num; i++) {
+        if (mons[i].width)
+            valid++;
+    }
+
+    // Check for clones and inactive outputs
+    valid -= monitors_drop_clones(mons, num);
+
+    if (valid > 0) {
+        monitor_t valid_mons[valid];
+        for (i = j = 0; i < num && j < valid; i++) {
+            if (mons[i].width != 0) {
+                valid_mons[j++] = mons[i];
+            }
+        }
+
+        monitor_create_chain(valid_mons, valid);
+    } else {
+        fprintf(stderr, "No usable RandR output found\n");
+    }
+
+    for (i = 0; i < num; i++) {
+        free(mons[i].name);
+    }
+    free(mons);
+}
+
+#ifdef WITH_XINERAMA
+void
+get_xinerama_monitors (void)
+{
+    xcb_xinerama_query_screens_reply_t *xqs_reply;
+    xcb_xinerama_screen_info_iterator_t iter;
+    int screens;
+
+    if (num_outputs) {
+        fprintf(stderr, "Using output names with Xinerama is not yet supported\n");
+        return;
+    }
+
+    xqs_reply = xcb_xinerama_query_screens_reply(c,
+            xcb_xinerama_query_screens_unchecked(c), NULL);
+
+    iter = xcb_xinerama_query_screens_screen_info_iterator(xqs_reply);
+    screens = iter.rem;
+
+    monitor_t mons[screens];
+
+    // Fetch all the screens first
+    for (int i = 0; iter.rem; i++) {
+        mons[i].name = NULL;
+        mons[i].x = iter.data->x_org;
+        mons[i].y = iter.data->y_org;
+        mons[i].width = iter.data->width;
+        mons[i].height = iter.data->height;
+        xcb_xinerama_screen_info_next(&iter);
+    }
+
+    free(xqs_reply);
+
+    monitor_create_chain(mons, screens);
+}
+#endif
+
+xcb_visualid_t
+get_visual (void)
+{
+    xcb_depth_iterator_t iter;
+
+    iter = xcb_screen_allowed_depths_iterator(scr);
+
+    // Try to find a RGBA visual
+    while (iter.rem) {
+        xcb_visualtype_t *vis = xcb_depth_visuals(iter.data);
+
+        if (iter.data->depth == 32)
+            return vis->visual_id;
+
+        xcb_depth_next(&iter);
+    }
+
+    // Fallback to the default one
+    return scr->root_visual;
+}
+
+// Parse an X-styled geometry string, we don't support signed offsets though.
+bool
+parse_geometry_string (char *str, int *tmp)
+{
+    char *p = str;
+    int i = 0, j;
+
+    if (!str || !str[0])
+        return false;
+
+    // The leading = is optional
+    if (*p == '=')
+        p++;
+
+    while (*p) {
+        // A geometry string has only 4 fields
+        if (i >= 4) {
+            fprintf(stderr, "Invalid geometry specified\n");
+            return false;
+        }
+        // Move on if we encounter a 'x' or '+'
+        if (*p == 'x') {
+            if (i > 0) // The 'x' must precede '+'
+                break;
+            i++; p++; continue;
+        }
+        if (*p == '+') {
+            if (i < 1) // Stray '+', skip the first two fields
+                i = 2;
+            else
+                i++;
+            p++; continue;
+        }
+        // A digit must follow
+        if (!isdigit(*p)) {
+            fprintf(stderr, "Invalid geometry specified\n");
+            return false;
+        }
+        // Try to parse the number
+        errno = 0;
+        j = strtoul(p, &p, 10);
+        if (errno) {
+            fprintf(stderr, "Invalid geometry specified\n");
+            return false;
+        }
+        tmp[i] = j;
+    }
+
+    return true;
+}
+
+// Parse a comma separated list of colors.
+void
+parse_palette_string (char *str)
+{
+    char *p = str, *ep;
+
+    while (*p) {
+        rgba_t color = parse_color(p, &ep, BLACK);
+
+        if (ep == p || (*ep && *ep != ',')) {
+            fprintf(stderr, "Invalid palette specified\n");
+            return;
+        }
+
+        palette = xreallocarray(palette, palette_count + 1, sizeof(rgba_t));
+        palette[palette_count++] = color;
+
+        p = (*ep == ',') ? ep + 1 : ep;
+    }
+}
+
+void
+parse_output_string(char *str)
+{
+    if (!str || !*str)
+        return;
+    output_names = xreallocarray(output_names, num_outputs + 1, sizeof(char*));
+    output_names[num_outputs++] = xstrdup(str);
+}
+
+void
+parse_mirror_string (char *str)
+{
+    char *name, *save;
+
+    for (name = strtok_r(str, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        mirror_names = xreallocarray(mirror_names, num_mirrors + 1, sizeof(char *));
+        mirror_groups = xreallocarray(mirror_groups, num_mirrors + 1, sizeof(int));
+        mirror_names[num_mirrors] = xstrdup(name);
+        mirror_groups[num_mirrors++] = num_mirror_groups;
+    }
+
+    num_mirror_groups++;
+}
+
+void
+xconn (void)
+{
+    // Connect to X
+    c = xcb_connect (NULL, NULL);
+    if (xcb_connection_has_error(c)) {
+        fprintf(stderr, "Couldn't connect to X\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Grab infos from the first screen
+    scr = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+
+    // Try to get a RGBA visual and build the colormap for that
+    visual = get_visual();
+    depth = (visual == scr->root_visual) ? scr->root_depth : 32;
+
+    colormap = xcb_generate_id(c);
+    xcb_create_colormap(c, XCB_COLORMAP_ALLOC_NONE, colormap, scr->root, visual);
+}
+
+void
+init (void)
+{
+    font_setup();
+
+    // Try to load a default font
+    if (font_count == 0) {
+        font_load("fixed");
+        font_setup();
+    }
+
+    // We tried and failed hard, there's something wrong
+    if (!font_count)
+        exit(EXIT_FAILURE);
+
+    // To make the alignment uniform, find maximum height
+    int maxh = font_list[0]->height;
+    for (int i = 1; i < font_count; i++)
+        maxh = max(maxh, font_list[i]->height);
+
+    // Set maximum height to all fonts
+    for (int i = 0; i < font_count; i++)
+        font_list[i]->height = maxh;
+
+    if (client_render && !image_check()) {
+        fprintf(stderr, "The pixel format isn't supported, drawing on the server side\n");
+        client_render = false;
+    }
+
+    // Generate a list of screens
+    const xcb_query_extension_reply_t *qe_reply;
+
+    // Initialize monitor list head and tail
+    monhead = montail = NULL;
+
+    // Check if RandR is present
+    qe_reply = xcb_get_extension_data(c, &xcb_randr_id);
+
+    if (qe_reply && qe_reply->present) {
+        get_randr_monitors();
+
+        // Follow the changes to the monitor configuration
+        randr_base = qe_reply->first_event;
+        xcb_randr_select_input(c, scr->root, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE | XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+    }
+#if WITH_XINERAMA
+    else {
+        qe_reply = xcb_get_extension_data(c, &xcb_xinerama_id);
+
+        // Check if Xinerama extension is present and active
+        if (qe_reply && qe_reply->present) {
+            xcb_xinerama_is_active_reply_t *xia_reply;
+            xia_reply = xcb_xinerama_is_active_reply(c, xcb_xinerama_is_active(c), NULL);
+
+            if (xia_reply && xia_reply->state)
+                get_xinerama_monitors();
+
+            free(xia_reply);
+        }
+    }
+#endif
+
+    if (!monhead && num_outputs != 0) {
+        fprintf(stderr, "Failed to find any specified outputs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!monhead) {
+        // If I fits I sits
+        if (bw < 0)
+            bw = scr->width_in_pixels - bx;
+
+        // Adjust the height
+        if (bh < 0 || bh > scr->height_in_pixels)
+            bh = maxh + bu + 2;
+
+        // Check the geometry
+        if (bx + bw > scr->width_in_pixels || by + bh > scr->height_in_pixels) {
+            fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // If no RandR outputs or Xinerama screens, fall back to using whole screen
+        monhead = monitor_new(0, 0, bw, scr->height_in_pixels, NULL);
+    }
+
+    if (!monhead)
+        exit(EXIT_FAILURE);
+
+    // Draw each monitor on its own thread, the main thread takes one too
+    workers_setup();
+
+    // For WM that support EWMH atoms
+    set_ewmh_atoms();
+
+    // Create the gc for copying the pixmaps around, we're not interested in
+    // the NoExpose events
+    gc_copy = xcb_generate_id(c);
+    xcb_create_gc(c, gc_copy, monhead->pixmap, XCB_GC_GRAPHICS_EXPOSURES, (const uint32_t []){ 0 });
+
+    // Warm up the pool with the default and the palette colors
+    gc_get(dbgc, NULL);
+    gc_get(dfgc, font_list[0]);
+    gc_get(dugc, NULL);
+    for (unsigned i = 0; i < palette_count && gc_pool_count < GC_POOL_SIZE / 2; i++)
+        gc_get(palette[i], NULL);
+
+    // Make the bar visible and clear the pixmap
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        monitor_show(mon);
+
+    xcb_flush(c);
+}
+
+// Rebuild the monitor list after the RandR configuration changed, the windows
+// of the outputs that are still around are kept and only moved or resized.
+// The last line is then parsed again from scratch since the layout refers to
+// the old monitors.
+void
+monitors_update (void)
+{
+    monitor_t *old_head = monhead, *old_tail = montail;
+    const int old_bw = bw;
+    int old_count = 0;
+
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        old_count++;
+
+    monitor_t *old[old_count + 1];
+
+    old_count = 0;
+    for (monitor_t *mon = monhead; mon; mon = mon->next)
+        old[old_count++] = mon;
+
+    // Every monitor gets its own pixmap back, the mirrors are found again
+    // once the line is parsed
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        if (mon->mirror)
+            monitor_unmirror(mon);
+    }
+
+    // The monitors are picked out of this list while the new chain is built
+    mon_stale = monhead;
+    monhead = montail = NULL;
+    bw = bw_geom;
 
-    return ret;
-}
+    get_randr_monitors();
 
-void
-monitor_add (monitor_t *mon)
-{
+    // Keep on using the previous configuration if the new one is unusable,
+    // the monitors have been given new pixmaps and are drawn again anyway
     if (!monhead) {
-        monhead = mon;
-    } else if (!montail) {
-        montail = mon;
-        monhead->next = mon;
-        mon->prev = monhead;
-    } else {
-        mon->prev = montail;
-        montail->next = mon;
-        montail = montail->next;
+        monhead = old_head;
+        montail = old_tail;
+        mon_stale = NULL;
+        bw = old_bw;
     }
-}
 
-int
-mon_sort_cb (const void *p1, const void *p2)
-{
-    const monitor_t *m1 = (monitor_t *)p1;
-    const monitor_t *m2 = (monitor_t *)p2;
+    while (mon_stale) {
+        monitor_t *next = mon_stale->next;
+        monitor_free(mon_stale);
+        mon_stale = next;
+    }
 
-    if (m1->x < m2->x || m1->y + m1->height <= m2->y)
-        return -1;
-    if (m1->x > m2->x || m1->y + m1->height > m2->y)
-        return  1;
+    for (monitor_t *mon = monhead; mon; mon = mon->next) {
+        bool reused = false;
 
-    return 0;
+        for (int i = 0; i < old_count && !reused; i++)
+            reused = old[i] == mon;
+
+        if (!reused) {
+            set_ewmh_props(mon);
+            monitor_show(mon);
+        }
+
+        mon->dirty_count = 0;
+        damage_add(mon, 0, mon->width);
+    }
+
+    workers_setup();
+
+    layout_reset(prev_lay);
+    line_valid = false;
+    tmpl.valid = false;
+
+    bin.valid = false;
+
+    if (bin.enabled) {
+        char *frame = xmalloc(bin.frame_len + 1);
+        memcpy(frame, bin.frame ? bin.frame : "", bin.frame_len);
+        bin_run(frame, bin.frame_len);
+        free(frame);
+        return;
+    }
+
+    if (tmpl.ops.count) {
+        char *line = xstrdup(tmpl.line ? tmpl.line : "");
+        tmpl_run(line);
+        free(line);
+        return;
+    }
+
+    char *line = xstrdup(line_prev ? line_prev : "");
+    parse(line);
+    free(line);
 }
 
 void
-monitor_create_chain (monitor_t *mons, const int num)
+cleanup (void)
 {
-    int i;
-    int width = 0, height = 0;
-    int left = bx;
-
-    // Sort before use, but only if specific outputs were not specified on command line
-    if (!num_outputs)
-        qsort(mons, num, sizeof(monitor_t), mon_sort_cb);
+    if (workers.count)
+        workers_stop();
 
-    for (i = 0; i < num; i++) {
-        int h = mons[i].y + mons[i].height;
-        // Accumulated width of all monitors
-        width += mons[i].width;
-        // Get height of screen from y_offset + height of lowest monitor
-        if (h >= height)
-        height = h;
+    for (int i = 0; i < num_outputs; i++) {
+        free(output_names[i]);
     }
+    free(output_names);
 
-    if (bw < 0)
-        bw = width - bx;
+    for (int i = 0; i < num_mirrors; i++)
+        free(mirror_names[i]);
+    free(mirror_names);
+    free(mirror_groups);
 
-    // Use the first font height as all the font heights have been set to the biggest of the set
-    if (bh < 0 || bh > height)
-        bh = font_list[0]->height + bu + 2;
+    free(area_stack.ptr);
 
-    // Check the geometry
-    if (bx + bw > width || by + bh > height) {
-        fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
-        exit(EXIT_FAILURE);
+    free(line_prev);
+    free(line_buf);
+    free(ckpts);
+    free(ucs_buf);
+
+    for (unsigned i = 0; i < tmpl.ops.count; i++)
+        free(tmpl.ops.ptr[i].ucs);
+    free(tmpl.ops.ptr);
+    free(tmpl.slots);
+    free(tmpl.src);
+    free(tmpl.line);
+
+    free(bin.cur.ops.ptr);
+    free(bin.cur.ucs);
+    free(bin.cur.strs);
+    free(bin.next.ops.ptr);
+    free(bin.next.ucs);
+    free(bin.next.strs);
+    free(bin.frame);
+
+    for (int i = 0; i < 2; i++) {
+        free(layouts[i].blocks);
+        free(layouts[i].segs);
+        free(layouts[i].glyphs);
     }
 
-    // Left is a positive number or zero therefore monitors with zero width are excluded
-    width = bw;
-    for (i = 0; i < num; i++) {
-        if (mons[i].y + mons[i].height < by)
-            continue;
-        if (mons[i].width > left) {
-            monitor_t *mon = monitor_new(
-                    mons[i].x + left,
-                    mons[i].y,
-                    min(width, mons[i].width - left),
-                    mons[i].height,
-                    mons[i].name? xstrdup(mons[i].name) : NULL);
+    for (int i = 0; i < font_count; i++) {
+#if WITH_RENDER
+        if (font_list[i]->face) {
+            FT_Done_Face(font_list[i]->face);
+            xcb_render_free_glyph_set(c, font_list[i]->glyphset);
+            for (int j = 0; j < GLYPH_PAGES; j++)
+                free(font_list[i]->advance[j]);
+        }
+#endif
+        if (font_list[i]->ptr)
+            xcb_close_font(c, font_list[i]->ptr);
+        for (int j = 0; font_list[i]->bitmaps && j < GLYPH_PAGES; j++) {
+            if (!font_list[i]->bitmaps[j])
+                continue;
+            for (int k = 0; k < 256; k++)
+                free(font_list[i]->bitmaps[j][k].data);
+            free(font_list[i]->bitmaps[j]);
+        }
+        free(font_list[i]->bitmaps);
+        font_metrics_free(font_list[i]);
+        free(font_list[i]->pattern);
+        free(font_list[i]);
+    }
+    free(font_list);
+    free(font_path);
+    font_map_reset();
+
+#if WITH_RENDER
+    for (unsigned i = 0; i < pen_pool_count; i++)
+        xcb_render_free_picture(c, pen_pool[i].pict);
+    if (ft_lib)
+        FT_Done_FreeType(ft_lib);
+#endif
 
-            if (!mon)
-                break;
+    while (monhead) {
+        monitor_t *next = monhead->next;
+        monitor_free(monhead);
+        monhead = next;
+    }
 
-            monitor_add(mon);
+    while (cache.head)
+        cache_unlink(cache.head);
 
-            width -= mons[i].width - left;
+    xcb_free_colormap(c, colormap);
 
-            // No need to check for other monitors
-            if (width <= 0)
-                break;
-        }
+    if (gc_copy)
+        xcb_free_gc(c, gc_copy);
+    for (unsigned i = 0; i < gc_pool_count; i++)
+        xcb_free_gc(c, gc_pool[i].gc);
 
-        left -= mons[i].width;
+    free(palette);
+    free(wm_name);
+    free(input.buf);
+    free(frame.line);
 
-        if (left < 0)
-            left = 0;
+    if (ctl.fd >= 0) {
+        close(ctl.fd);
+        unlink(ctl.path);
     }
+    for (int i = 0; i < CTL_CLIENTS; i++) {
+        free(ctl.clients[i].buf);
+        if (ctl.clients[i].ring) {
+            munmap(ctl.clients[i].ring, sizeof(struct lemonbar_ring) + ctl.clients[i].ring_size);
+            free(ctl.clients[i].ring_block);
+        }
+    }
+    for (unsigned i = 0; i < ctl.block_count; i++) {
+        free(ctl.blocks[i].name);
+        free(ctl.blocks[i].text);
+    }
+    free(ctl.blocks);
+    free(ctl.line);
+    free(ctl.path);
+    for (unsigned i = 0; i < provs.count; i++)
+        free(provs.ptr[i].arg);
+    free(provs.ptr);
+    free(provs.line);
+    if (c)
+        xcb_disconnect(c);
 }
 
-void
-get_randr_monitors (void)
+// Check whether there's more data waiting on stdin
+bool
+input_pending (void)
 {
-    xcb_randr_get_screen_resources_current_reply_t *rres_reply;
-    xcb_randr_output_t *outputs;
-    int i, j, num, valid = 0;
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
 
-    rres_reply = xcb_randr_get_screen_resources_current_reply(c,
-            xcb_randr_get_screen_resources_current(c, scr->root), NULL);
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
 
-    if (!rres_reply) {
-        fprintf(stderr, "Failed to get current randr screen resources\n");
-        return;
+// Move past the complete lines read so far and keep the offset and the length
+// of the last one. The data before scan is known to hold no newline
+bool
+input_scan_lines (char *scan, bool found, size_t *line, size_t *size)
+{
+    if (input.skipping) {
+        char *nl = memchr(scan, '\n', input.buf + input.tail - scan);
+        if (!nl) {
+            input.head = input.tail = 0;
+            return found;
+        }
+        input.skipping = false;
+        input.head = nl + 1 - input.buf;
+        scan = nl + 1;
     }
 
-    num = xcb_randr_get_screen_resources_current_outputs_length(rres_reply);
-    outputs = xcb_randr_get_screen_resources_current_outputs(rres_reply);
+    char *last_nl = memrchr(scan, '\n', input.buf + input.tail - scan);
+    if (!last_nl)
+        return found;
 
-    // There should be at least one output
-    if (num < 1) {
-        free(rres_reply);
-        return;
+    // Only the last complete line is shown, the ones before it are stale
+    char *begin = input.buf + input.head;
+    for (char *nl; (nl = memchr(begin, '\n', last_nl - begin)); begin = nl + 1) {
+        input.lines++;
+        input.superseded++;
     }
+    if (found)
+        input.superseded++;
 
-    // Every entry starts with a size of 0, making it invalid until we fill in
-    // the data retrieved from the Xserver.
-    monitor_t *mons = xcalloc(max(num, num_outputs), sizeof(monitor_t));
+    *last_nl = '\0';
+    input.lines++;
+    input.head = last_nl + 1 - input.buf;
+    *line = begin - input.buf;
+    *size = last_nl - begin;
 
-    // Get all outputs
-    for (i = 0; i < num; i++) {
-        xcb_randr_get_output_info_reply_t *oi_reply;
-        xcb_randr_get_crtc_info_reply_t *ci_reply;
+    return true;
+}
+
+// Move past the complete frames read so far and keep the offset and the size
+// of the last one, the frames too large to fit are thrown away
+bool
+input_scan_frames (bool found, size_t *frame, size_t *size)
+{
+    for (;;) {
+        const size_t skip = min(input.skip, input.tail - input.head);
+        uint32_t frame_size;
 
-        oi_reply = xcb_randr_get_output_info_reply(c, xcb_randr_get_output_info(c, outputs[i], XCB_CURRENT_TIME), NULL);
+        input.head += skip;
+        input.skip -= skip;
 
-        // Output disconnected or not attached to any CRTC ?
-        if (!oi_reply || oi_reply->crtc == XCB_NONE || oi_reply->connection != XCB_RANDR_CONNECTION_CONNECTED) {
-            free(oi_reply);
+        if (input.tail - input.head < 4)
+            return found;
+        memcpy(&frame_size, input.buf + input.head, 4);
+
+        if (frame_size > input.limit - 4) {
+            fprintf(stderr, "Dropping an input frame larger than %zu KiB\n", input.limit / 1024);
+            input.dropped++;
+            input.skip = (size_t)frame_size + 4;
             continue;
         }
+        if (input.tail - input.head < (size_t)frame_size + 4)
+            return found;
+
+        // Only the last complete frame is shown
+        if (found)
+            input.superseded++;
+        input.lines++;
+        *frame = input.head + 4;
+        *size = frame_size;
+        found = true;
+        input.head += (size_t)frame_size + 4;
+    }
+}
 
-        ci_reply = xcb_randr_get_crtc_info_reply(c,
-                xcb_randr_get_crtc_info(c, oi_reply->crtc, XCB_CURRENT_TIME), NULL);
+// Read what's available on stdin and return the last complete line, if any.
+// Unless drain is set the reading stops as soon as a complete line is found.
+// The line is terminated in place and stays valid until the next call. With
+// -i binary the input is made of frames preceded by their size instead
+char *
+input_read (bool drain, size_t *size)
+{
+    // The offset of the line found so far, if any
+    size_t line = 0;
+    bool found = false;
 
-        if (!ci_reply) {
-            fprintf(stderr, "Failed to get RandR crtc info\n");
-            free(rres_reply);
-            goto cleanup_mons;
+    for (;;) {
+        if (input.tail == input.alloc) {
+            // Don't throw away the line found so far
+            const size_t keep = found ? line : input.head;
+
+            if (keep) {
+                // Move what's left back to the beginning, only done once the
+                // end of the buffer is reached
+                memmove(input.buf, input.buf + keep, input.tail - keep);
+                input.tail -= keep;
+                input.head -= keep;
+                line -= found ? keep : 0;
+            } else if (input.alloc < input.limit) {
+                input.alloc = min(max(input.alloc * 2, 4096), input.limit);
+                input.buf = xrealloc(input.buf, input.alloc);
+            } else if (found) {
+                // The rest is read on the next wakeup
+                break;
+            } else {
+                // The line doesn't fit, throw it away up to its end
+                fprintf(stderr, "Dropping an input line longer than %zu KiB\n", input.limit / 1024);
+                input.dropped++;
+                input.skipping = true;
+                input.head = input.tail = 0;
+            }
+            continue;
         }
 
-        int name_len = xcb_randr_get_output_info_name_length(oi_reply);
-        uint8_t *name_ptr = xcb_randr_get_output_info_name(oi_reply);
+        ssize_t r = read(STDIN_FILENO, input.buf + input.tail, input.alloc - input.tail);
+        if (r == 0) {
+            input.eof = true;
+            break;
+        }
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            exit(EXIT_FAILURE);
+        }
 
-        bool is_valid = true;
+        // The data before the new one holds no newline, don't look at it again
+        char *scan = input.buf + input.tail;
+        input.tail += r;
 
-        if (num_outputs) {
-            // Skip outputs missing from the list.
-            is_valid = false;
-            // Allocate monitors following the specified order.
-            for (j = 0; j < num_outputs; j++) {
-                // Already allocated, the list contains a duplicate.
-                if (mons[j].name)
-                    break;
+        if (bin.enabled)
+            found = input_scan_frames(found, &line, size);
+        else
+            found = input_scan_lines(scan, found, &line, size);
 
-                if (!memcmp(output_names[j], name_ptr, name_len) &&
-                        strlen(output_names[j]) == name_len) {
-                    is_valid = true;
-                    break;
-                }
-            }
-        }
+        if (found && !drain)
+            break;
 
-        if (is_valid) {
-            char *alloc_name = xcalloc(name_len + 1, 1);
-            memcpy(alloc_name, name_ptr, name_len);
+        // Don't block waiting for the rest of a line
+        if (!input_pending())
+            break;
+    }
 
-            // There's no need to handle rotated screens here (see #69)
-            mons[i] = (monitor_t){ alloc_name, ci_reply->x, ci_reply->y,
-                ci_reply->width, ci_reply->height, 0, 0, NULL, NULL };
-            valid += 1;
-        }
+    // Start over from the beginning when everything has been consumed
+    if (input.head == input.tail)
+        input.head = input.tail = 0;
 
-        free(oi_reply);
-        free(ci_reply);
-    }
+    return found ? input.buf + line : NULL;
+}
 
-    free(rres_reply);
+// Get the number of milliseconds until the next frame can be drawn, or -1 if
+// it can be drawn right away
+int
+frame_timeout (void)
+{
+    struct timespec now;
 
-    // Check for clones and inactive outputs
-    for (i = 0; i < num; i++) {
-        if (mons[i].width == 0)
-            continue;
+    if (!frame.armed)
+        return -1;
 
-        for (j = 0; j < num; j++) {
-            // Does I contain J ?
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const long long ns = (frame.next.tv_sec - now.tv_sec) * 1000000000LL +
+        (frame.next.tv_nsec - now.tv_nsec);
 
-            if (i != j && mons[j].width) {
-                if (mons[j].x >= mons[i].x && mons[j].x + mons[j].width <= mons[i].x + mons[i].width &&
-                    mons[j].y >= mons[i].y && mons[j].y + mons[j].height <= mons[i].y + mons[i].height) {
-                    mons[j].width = 0;
-                    valid--;
-                }
-            }
-        }
+    return ns > 0 ? (int)((ns + 999999) / 1000000) : 0;
+}
+
+// Parse the line and hold back the following ones for a frame interval, the
+// length is only needed by the binary frames
+void
+frame_parse (char *line, const size_t len)
+{
+    if (bin.enabled)
+        bin_run(line, len);
+    else if (tmpl.ops.count)
+        tmpl_run(line);
+    else
+        parse(line);
+
+    if (frame.interval) {
+        clock_gettime(CLOCK_MONOTONIC, &frame.next);
+        frame.next.tv_nsec += frame.interval;
+        frame.next.tv_sec += frame.next.tv_nsec / 1000000000L;
+        frame.next.tv_nsec %= 1000000000L;
+        frame.armed = true;
     }
+}
 
-    if (valid > 0) {
-        monitor_t valid_mons[valid];
-        for (i = j = 0; i < num && j < valid; i++) {
-            if (mons[i].width != 0) {
-                valid_mons[j++] = mons[i];
-            }
-        }
+// Draw the line right away unless a frame interval is running, the newest one
+// is then held back until its end. Returns true if the line has been parsed
+bool
+frame_submit (char *line, const size_t len)
+{
+    if (!frame.armed) {
+        frame_parse(line, len);
+        return true;
+    }
 
-        monitor_create_chain(valid_mons, valid);
-    } else {
-        fprintf(stderr, "No usable RandR output found\n");
+    if (frame.pending)
+        input.superseded++;
+    if (frame.alloc < len + 1) {
+        frame.alloc = len + 1;
+        frame.line = xrealloc(frame.line, frame.alloc);
     }
+    memcpy(frame.line, line, len);
+    frame.line[len] = '\0';
+    frame.len = len;
+    frame.pending = true;
 
-cleanup_mons:
-    for (i = 0; i < num; i++) {
-        free(mons[i].name);
+    return false;
+}
+
+// The milliseconds until the next provider update is due, -1 if there's none
+int
+prov_timeout (void)
+{
+    long long ns = -1;
+
+    for (unsigned i = 0; i < provs.count; i++) {
+        const prov_t *p = &provs.ptr[i];
+
+        if (p->offset == SIZE_MAX && !p->in_tmpl)
+            continue;
+
+        const long long due = prov_due_in(p);
+        if (ns < 0 || due < ns)
+            ns = max(due, 0);
     }
-    free(mons);
+
+    return ns >= 0 ? (int)((ns + 999999) / 1000000) : -1;
 }
 
-#ifdef WITH_XINERAMA
-void
-get_xinerama_monitors (void)
+// Update the providers that are due and submit the line again, the parser then
+// starts over from the first block whose text changed. Returns true if
+// something has been drawn
+bool
+prov_refresh (void)
 {
-    xcb_xinerama_query_screens_reply_t *xqs_reply;
-    xcb_xinerama_screen_info_iterator_t iter;
-    int screens;
+    bool changed = false;
 
-    if (num_outputs) {
-        fprintf(stderr, "Using output names with Xinerama is not yet supported\n");
-        return;
+    for (unsigned i = 0; i < provs.count; i++) {
+        prov_t *p = &provs.ptr[i];
+
+        if ((p->offset == SIZE_MAX && !p->in_tmpl) || prov_due_in(p) > PROV_SLACK_NS)
+            continue;
+
+        if (prov_update(p)) {
+            provs.dirty_from = min(provs.dirty_from, tmpl.ops.count ? 0 : p->offset);
+            changed = true;
+        }
     }
 
-    xqs_reply = xcb_xinerama_query_screens_reply(c,
-            xcb_xinerama_query_screens_unchecked(c), NULL);
+    // The line held back picks the new values up once the frame is over
+    if (!changed || frame.pending)
+        return false;
 
-    iter = xcb_xinerama_query_screens_screen_info_iterator(xqs_reply);
-    screens = iter.rem;
+    const char *line = tmpl.ops.count ? tmpl.line : line_prev;
+    const size_t len = tmpl.ops.count ? tmpl.line_len : line_len;
 
-    monitor_t mons[screens];
+    if (tmpl.ops.count ? !tmpl.valid : !line_valid)
+        return false;
 
-    // Fetch all the screens first
-    for (int i = 0; iter.rem; i++) {
-        mons[i].name = NULL;
-        mons[i].x = iter.data->x_org;
-        mons[i].y = iter.data->y_org;
-        mons[i].width = iter.data->width;
-        mons[i].height = iter.data->height;
-        xcb_xinerama_screen_info_next(&iter);
+    // Submit the very same line again, only the provider values changed
+    if (len + 1 > provs.line_alloc) {
+        provs.line_alloc = len + 1;
+        provs.line = xrealloc(provs.line, provs.line_alloc);
     }
+    memcpy(provs.line, line, len + 1);
 
-    free(xqs_reply);
+    return frame_submit(provs.line, len);
+}
 
-    monitor_create_chain(mons, screens);
+named_block_t *
+ctl_block_find (const char *name)
+{
+    for (unsigned i = 0; i < ctl.block_count; i++) {
+        if (!strcmp(ctl.blocks[i].name, name))
+            return &ctl.blocks[i];
+    }
+
+    return NULL;
 }
-#endif
 
-xcb_visualid_t
-get_visual (void)
+bool
+ctl_block_define (const char *name, const char *text)
 {
-    xcb_depth_iterator_t iter;
+    if (ctl_block_find(name))
+        return false;
+
+    if (ctl.block_count == ctl.block_alloc) {
+        ctl.block_alloc = ctl.block_alloc ? ctl.block_alloc * 2 : 8;
+        ctl.blocks = xreallocarray(ctl.blocks, ctl.block_alloc, sizeof(named_block_t));
+    }
+    ctl.blocks[ctl.block_count++] = (named_block_t){
+        .name = xstrdup(name),
+        .text = xstrdup(text),
+    };
+    ctl.dirty |= *text != '\0';
 
-    iter = xcb_screen_allowed_depths_iterator(scr);
+    return true;
+}
 
-    // Try to find a RGBA visual
-    while (iter.rem) {
-        xcb_visualtype_t *vis = xcb_depth_visuals(iter.data);
+bool
+ctl_block_set (const char *name, const char *text, size_t len)
+{
+    named_block_t *block = ctl_block_find(name);
 
-        if (iter.data->depth == 32)
-            return vis->visual_id;
+    if (!block)
+        return false;
 
-        xcb_depth_next(&iter);
+    if (strlen(block->text) != len || memcmp(block->text, text, len)) {
+        free(block->text);
+        block->text = xmalloc(len + 1);
+        memcpy(block->text, text, len);
+        block->text[len] = '\0';
+        ctl.dirty = true;
     }
 
-    // Fallback to the default one
-    return scr->root_visual;
+    return true;
 }
 
-// Parse an X-styled geometry string, we don't support signed offsets though.
 bool
-parse_geometry_string (char *str, int *tmp)
+ctl_block_undefine (const char *name)
 {
-    char *p = str;
-    int i = 0, j;
+    named_block_t *block = ctl_block_find(name);
 
-    if (!str || !str[0])
+    if (!block)
         return false;
 
-    // The leading = is optional
-    if (*p == '=')
-        p++;
+    ctl.dirty |= *block->text != '\0';
+    free(block->name);
+    free(block->text);
+    ctl.block_count--;
+    memmove(block, block + 1, (ctl.blocks + ctl.block_count - block) * sizeof(named_block_t));
 
-    while (*p) {
-        // A geometry string has only 4 fields
-        if (i >= 4) {
-            fprintf(stderr, "Invalid geometry specified\n");
-            return false;
-        }
-        // Move on if we encounter a 'x' or '+'
-        if (*p == 'x') {
-            if (i > 0) // The 'x' must precede '+'
-                break;
-            i++; p++; continue;
-        }
-        if (*p == '+') {
-            if (i < 1) // Stray '+', skip the first two fields
-                i = 2;
-            else
-                i++;
-            p++; continue;
-        }
-        // A digit must follow
-        if (!isdigit(*p)) {
-            fprintf(stderr, "Invalid geometry specified\n");
-            return false;
-        }
-        // Try to parse the number
-        errno = 0;
-        j = strtoul(p, &p, 10);
-        if (errno) {
-            fprintf(stderr, "Invalid geometry specified\n");
-            return false;
-        }
-        tmp[i] = j;
+    return true;
+}
+
+// Put the line together, the blocks preceding the one that changed give the
+// very same prefix and parse() picks up from there
+char *
+ctl_compose (void)
+{
+    size_t len = 1;
+
+    for (unsigned i = 0; i < ctl.block_count; i++)
+        len += strlen(ctl.blocks[i].text);
+
+    if (len > ctl.line_alloc) {
+        ctl.line_alloc = len;
+        ctl.line = xrealloc(ctl.line, ctl.line_alloc);
     }
 
-    return true;
+    char *p = ctl.line;
+    for (unsigned i = 0; i < ctl.block_count; i++)
+        p = stpcpy(p, ctl.blocks[i].text);
+    *p = '\0';
+
+    return ctl.line;
 }
 
 void
-parse_output_string(char *str)
+ctl_reply (int fd, const char *msg)
 {
-    if (!str || !*str)
-        return;
-    output_names = xreallocarray(output_names, num_outputs + 1, sizeof(char*));
-    output_names[num_outputs++] = xstrdup(str);
+    // Don't wait for a client that isn't reading
+    (void)send(fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 void
-xconn (void)
+ctl_ring_detach (ctl_client_t *cl)
 {
-    // Connect to X
-    c = xcb_connect (NULL, NULL);
-    if (xcb_connection_has_error(c)) {
-        fprintf(stderr, "Couldn't connect to X\n");
-        exit(EXIT_FAILURE);
-    }
+    if (!cl->ring)
+        return;
 
-    // Grab infos from the first screen
-    scr = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+    munmap(cl->ring, sizeof(struct lemonbar_ring) + cl->ring_size);
+    close(cl->ring_fd);
+#ifndef F_GET_SEALS
+    close(cl->ring_mem);
+#endif
+    free(cl->ring_block);
+    cl->ring = NULL;
+    cl->ring_block = NULL;
+}
 
-    // Try to get a RGBA visual and build the colormap for that
-    visual = get_visual();
+// Map the ring whose memory and wakeup descriptors came along with the
+// command, returns the error to report if any
+const char *
+ctl_ring_attach (ctl_client_t *cl, const char *name)
+{
+    struct lemonbar_ring *ring;
+    struct stat st;
+    uint32_t size;
+
+    if (cl->fd_count != 2)
+        return "error: the ring needs a memory and a wakeup descriptor\n";
+    if (cl->ring)
+        return "error: a ring is already attached\n";
+    if (!ctl_block_find(name))
+        return "error: unknown block\n";
+
+#ifdef F_GET_SEALS
+    // Reading the pages cut off by the producer would kill the bar
+    const int seals = fcntl(cl->fds[0], F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_SEAL)) != (F_SEAL_SHRINK | F_SEAL_SEAL))
+        return "error: the ring memory isn't sealed against shrinking\n";
+#endif
 
-    colormap = xcb_generate_id(c);
-    xcb_create_colormap(c, XCB_COLORMAP_ALLOC_NONE, colormap, scr->root, visual);
+    if (fstat(cl->fds[0], &st) < 0 || (size_t)st.st_size < sizeof(*ring) + LEMONBAR_RING_MIN)
+        return "error: invalid ring\n";
+    ring = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, cl->fds[0], 0);
+    if (ring == MAP_FAILED)
+        return "error: invalid ring\n";
+
+    // The size is read once, the shared copy isn't trusted afterwards
+    size = ring->size;
+    if (ring->magic != LEMONBAR_RING_MAGIC || (size & (size - 1)) ||
+            size < LEMONBAR_RING_MIN || size > LEMONBAR_RING_MAX ||
+            sizeof(*ring) + size > (size_t)st.st_size) {
+        munmap(ring, (size_t)st.st_size);
+        return "error: invalid ring\n";
+    }
+    if (sizeof(*ring) + size < (size_t)st.st_size)
+        munmap((char *)ring + sizeof(*ring) + size, (size_t)st.st_size - sizeof(*ring) - size);
+
+#ifdef F_GET_SEALS
+    close(cl->fds[0]);
+#else
+    cl->ring_mem = cl->fds[0];
+#endif
+    (void)fcntl(cl->fds[1], F_SETFL, O_NONBLOCK);
+    cl->ring = ring;
+    cl->ring_size = size;
+    cl->ring_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    cl->ring_fd = cl->fds[1];
+    cl->ring_block = xstrdup(name);
+    cl->fd_count = 0;
+
+    return NULL;
 }
 
+// Consume every entry published so far, only the newest one is shown and it's
+// copied straight from the shared memory into its block
 void
-init (char *wm_name)
+ctl_ring_read (struct pollfd *pfd, ctl_client_t *cl)
 {
-    // Try to load a default font
-    if (font_count == 0)
-        font_load("fixed");
+    struct lemonbar_ring *ring = cl->ring;
+    const uint64_t size = cl->ring_size;
+    const unsigned char *latest = NULL;
+    uint32_t latest_len = 0;
+    uint64_t wakeups[8];
+
+    // Reset the wakeup before looking at the ring so no entry is missed
+    ssize_t r = read(cl->ring_fd, wakeups, sizeof(wakeups));
+
+#ifndef F_GET_SEALS
+    struct stat st;
+    if (fstat(cl->ring_mem, &st) < 0 || (size_t)st.st_size < sizeof(*ring) + size)
+        goto corrupt;
+#endif
 
-    // We tried and failed hard, there's something wrong
-    if (!font_count)
-        exit(EXIT_FAILURE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = cl->ring_tail;
 
-    // To make the alignment uniform, find maximum height
-    int maxh = font_list[0]->height;
-    for (int i = 1; i < font_count; i++)
-        maxh = max(maxh, font_list[i]->height);
+    if (head - tail > size)
+        goto corrupt;
 
-    // Set maximum height to all fonts
-    for (int i = 0; i < font_count; i++)
-        font_list[i]->height = maxh;
+    while (tail != head) {
+        uint64_t off = tail & (size - 1);
+        uint64_t room = size - off;
+        uint32_t len;
 
-    // Generate a list of screens
-    const xcb_query_extension_reply_t *qe_reply;
+        memcpy(&len, ring->data + off, sizeof(len));
+        if (len == LEMONBAR_RING_WRAP) {
+            if (room > head - tail)
+                goto corrupt;
+            tail += room;
+            continue;
+        }
+        if (LEMONBAR_RING_ENTRY(len) > min(room, head - tail) || ring->data[off + 4 + len] != '\0')
+            goto corrupt;
+
+        if (latest)
+            input.superseded++;
+        input.lines++;
+        latest = ring->data + off + 4;
+        latest_len = len;
+        tail += LEMONBAR_RING_ENTRY(len);
+    }
 
-    // Initialize monitor list head and tail
-    monhead = montail = NULL;
+    if (latest)
+        (void)ctl_block_set(cl->ring_block, (const char *)latest, latest_len);
 
-    // Check if RandR is present
-    qe_reply = xcb_get_extension_data(c, &xcb_randr_id);
+    // Hand the space back only once the entry has been copied
+    cl->ring_tail = tail;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 
-    if (qe_reply && qe_reply->present) {
-        get_randr_monitors();
-    }
-#if WITH_XINERAMA
-    else {
-        qe_reply = xcb_get_extension_data(c, &xcb_xinerama_id);
+    // The producer closed its end of the wakeup pipe
+    if (r == 0)
+        ctl_ring_detach(cl);
+    return;
 
-        // Check if Xinerama extension is present and active
-        if (qe_reply && qe_reply->present) {
-            xcb_xinerama_is_active_reply_t *xia_reply;
-            xia_reply = xcb_xinerama_is_active_reply(c, xcb_xinerama_is_active(c), NULL);
+corrupt:
+    ctl_reply(pfd->fd, "error: corrupted ring\n");
+    ctl_ring_detach(cl);
+}
 
-            if (xia_reply && xia_reply->state)
-                get_xinerama_monitors();
+// Execute a single command, the text is whatever follows the block name
+void
+ctl_command (ctl_client_t *cl, int fd, char *cmd)
+{
+    char *name, *text;
+    bool ok;
 
-            free(xia_reply);
-        }
+    name = cmd + strcspn(cmd, " ");
+    if (*name)
+        *name++ = '\0';
+    text = name + strcspn(name, " ");
+    if (*text)
+        *text++ = '\0';
+
+    if (!*cmd)
+        return;
+
+    if (!*name) {
+        ctl_reply(fd, "error: missing block name\n");
+        return;
     }
-#endif
 
-    if (!monhead && num_outputs != 0) {
-        fprintf(stderr, "Failed to find any specified outputs\n");
-        exit(EXIT_FAILURE);
+    if (!strcmp(cmd, "define"))
+        ok = ctl_block_define(name, text);
+    else if (!strcmp(cmd, "set"))
+        ok = ctl_block_set(name, text, strlen(text));
+    else if (!strcmp(cmd, "undefine"))
+        ok = ctl_block_undefine(name);
+    else if (!strcmp(cmd, "ring")) {
+        const char *err = ctl_ring_attach(cl, name);
+        if (err) {
+            ctl_reply(fd, err);
+            // Don't keep the descriptors around for the next attempt
+            for (unsigned i = 0; i < cl->fd_count; i++)
+                close(cl->fds[i]);
+            cl->fd_count = 0;
+        }
+        return;
+    }
+    else {
+        ctl_reply(fd, "error: unknown command\n");
+        return;
     }
 
-    if (!monhead) {
-        // If I fits I sits
-        if (bw < 0)
-            bw = scr->width_in_pixels - bx;
+    if (!ok)
+        ctl_reply(fd, !strcmp(cmd, "define") ? "error: block already defined\n" : "error: unknown block\n");
+}
 
-        // Adjust the height
-        if (bh < 0 || bh > scr->height_in_pixels)
-            bh = maxh + bu + 2;
+void
+ctl_drop (struct pollfd *pfd, ctl_client_t *cl)
+{
+    close(pfd->fd);
+    pfd->fd = -1;
+    free(cl->buf);
+    ctl_ring_detach(cl);
+    for (unsigned i = 0; i < cl->fd_count; i++)
+        close(cl->fds[i]);
+    *cl = (ctl_client_t){ 0 };
+}
 
-        // Check the geometry
-        if (bx + bw > scr->width_in_pixels || by + bh > scr->height_in_pixels) {
-            fprintf(stderr, "The geometry specified doesn't fit the screen!\n");
-            exit(EXIT_FAILURE);
+// Run the complete commands sent by the client
+void
+ctl_read (struct pollfd *pfd, ctl_client_t *cl)
+{
+    if (cl->len == cl->alloc) {
+        if (cl->alloc >= input.limit) {
+            ctl_reply(pfd->fd, "error: command too long\n");
+            ctl_drop(pfd, cl);
+            return;
         }
-
-        // If no RandR outputs or Xinerama screens, fall back to using whole screen
-        monhead = monitor_new(0, 0, bw, scr->height_in_pixels, NULL);
+        cl->alloc = min(max(cl->alloc * 2, 256), input.limit);
+        cl->buf = xrealloc(cl->buf, cl->alloc);
     }
 
-    if (!monhead)
-        exit(EXIT_FAILURE);
-
-    // For WM that support EWMH atoms
-    set_ewmh_atoms();
+    // The ring command comes with its descriptors attached
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(cl->fds))];
+    } ctrl;
+    struct iovec iov = { .iov_base = cl->buf + cl->len, .iov_len = cl->alloc - cl->len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+#ifdef MSG_CMSG_CLOEXEC
+    ssize_t r = recvmsg(pfd->fd, &msg, MSG_CMSG_CLOEXEC);
+#else
+    ssize_t r = recvmsg(pfd->fd, &msg, 0);
+#endif
+    if (r < 0 && errno == EINTR)
+        return;
 
-    // Create the gc for drawing
-    gc[GC_DRAW] = xcb_generate_id(c);
-    xcb_create_gc(c, gc[GC_DRAW], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ fgc.v });
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); r >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
 
-    gc[GC_CLEAR] = xcb_generate_id(c);
-    xcb_create_gc(c, gc[GC_CLEAR], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ bgc.v });
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            // Keep the first pair only
+            if (cl->fd_count < 2)
+                cl->fds[cl->fd_count++] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (r <= 0) {
+        // Take the last command even if it isn't terminated by a newline
+        if (r == 0 && cl->len < cl->alloc) {
+            cl->buf[cl->len] = '\0';
+            ctl_command(cl, pfd->fd, cl->buf);
+        }
+        ctl_drop(pfd, cl);
+        return;
+    }
+    cl->len += r;
 
-    gc[GC_ATTR] = xcb_generate_id(c);
-    xcb_create_gc(c, gc[GC_ATTR], monhead->pixmap, XCB_GC_FOREGROUND, (const uint32_t []){ ugc.v });
+    char *begin = cl->buf, *nl;
+    while ((nl = memchr(begin, '\n', cl->buf + cl->len - begin))) {
+        *nl = '\0';
+        ctl_command(cl, pfd->fd, begin);
+        begin = nl + 1;
+    }
+    cl->len -= begin - cl->buf;
+    memmove(cl->buf, begin, cl->len);
+}
 
-    // Make the bar visible and clear the pixmap
-    for (monitor_t *mon = monhead; mon; mon = mon->next) {
-        fill_rect(mon->pixmap, gc[GC_CLEAR], 0, 0, mon->width, bh);
-        xcb_map_window(c, mon->window);
+void
+ctl_accept (struct pollfd *slots)
+{
+    int fd = accept(ctl.fd, NULL, NULL);
 
-        // Make sure that the window really gets in the place it's supposed to be
-        // Some WM such as Openbox need this
-        xcb_configure_window(c, mon->window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_STACK_MODE, (const uint32_t []){ mon->x, mon->y, XCB_STACK_MODE_BELOW });
+    if (fd < 0)
+        return;
 
-        // Set the WM_NAME atom to the user specified value
-        if (wm_name)
-            xcb_change_property(c, XCB_PROP_MODE_REPLACE, mon->window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8 ,strlen(wm_name), wm_name);
+    for (int i = 0; i < CTL_CLIENTS; i++) {
+        if (slots[i].fd < 0) {
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+            slots[i].fd = fd;
+            return;
+        }
     }
 
-    xcb_flush(c);
+    ctl_reply(fd, "error: too many clients\n");
+    close(fd);
 }
 
 void
-cleanup (void)
+ctl_open (const char *path)
 {
-    for (int i = 0; i < num_outputs; i++) {
-        free(output_names[i]);
-    }
-    free(output_names);
-
-    free(area_stack.ptr);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
-    for (int i = 0; i < font_count; i++) {
-        xcb_close_font(c, font_list[i]->ptr);
-        free(font_list[i]->width_lut);
-        free(font_list[i]);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "The socket path \"%s\" is too long\n", path);
+        exit(EXIT_FAILURE);
     }
-    free(font_list);
+    strcpy(addr.sun_path, path);
 
-    while (monhead) {
-        monitor_t *next = monhead->next;
-        xcb_destroy_window(c, monhead->window);
-        xcb_free_pixmap(c, monhead->pixmap);
-        free(monhead->name);
-        free(monhead);
-        monhead = next;
+    ctl.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl.fd < 0) {
+        fprintf(stderr, "Couldn't create the control socket\n");
+        exit(EXIT_FAILURE);
+    }
+    (void)fcntl(ctl.fd, F_SETFD, FD_CLOEXEC);
+
+    // Take over the socket left behind by a bar that's gone, but not the one
+    // of a bar still running
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0) {
+        if (!connect(probe, (struct sockaddr *)&addr, sizeof(addr))) {
+            fprintf(stderr, "The socket \"%s\" is already in use\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (errno == ECONNREFUSED)
+            unlink(path);
+        close(probe);
     }
 
-    xcb_free_colormap(c, colormap);
+    if (bind(ctl.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ctl.fd, 8) < 0) {
+        fprintf(stderr, "Couldn't listen on \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    ctl.path = xstrdup(path);
 
-    if (gc[GC_DRAW])
-        xcb_free_gc(c, gc[GC_DRAW]);
-    if (gc[GC_CLEAR])
-        xcb_free_gc(c, gc[GC_CLEAR]);
-    if (gc[GC_ATTR])
-        xcb_free_gc(c, gc[GC_ATTR]);
-    if (c)
-        xcb_disconnect(c);
+    // The lines read from stdin make a block on their own
+    ctl_block_define("stdin", "");
 }
 
 void
 sighandle (int signal)
 {
     if (signal == SIGINT || signal == SIGTERM)
-        exit(EXIT_SUCCESS);
+        quit = true;
+    if (signal == SIGUSR1)
+        dump_stats = true;
+}
+
+void
+print_stats (void)
+{
+    fprintf(stderr, "cache: %lu hits, %lu misses, %u entries, %zu/%zu KiB\n",
+            cache.hits, cache.misses, cache.entries, cache.size / 1024, cache.limit / 1024);
+    fprintf(stderr, "input: %lu lines, %lu superseded, %lu dropped, %zu/%zu KiB\n",
+            input.lines, input.superseded, input.dropped, input.alloc / 1024, input.limit / 1024);
 }
 
 int
 main (int argc, char **argv)
 {
-    struct pollfd pollin[2] = {
-        { .fd = STDIN_FILENO, .events = POLLIN },
-        { .fd = -1          , .events = POLLIN },
-    };
+    // The control socket, its clients and their rings follow stdin and the X
+    // connection
+    struct pollfd pollin[3 + 2 * CTL_CLIENTS];
+    struct pollfd *ctl_slots = &pollin[3];
+    struct pollfd *ring_slots = &pollin[3 + CTL_CLIENTS];
     xcb_generic_event_t *ev;
     xcb_expose_event_t *expose_ev;
     xcb_button_press_event_t *press_ev;
-    char input[4096] = {0, };
-    size_t input_offset = 0;
     bool permanent = false;
     int geom_v[4] = { -1, -1, 0, 0 };
+    const char *ctl_path = NULL;
+    const char *tmpl_src = NULL;
     int ch;
-    char *wm_name;
+
+    pollin[0] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+    for (int i = 1; i < 3 + 2 * CTL_CLIENTS; i++)
+        pollin[i] = (struct pollfd){ .fd = -1, .events = POLLIN };
 
     // Install the parachute!
     atexit(cleanup);
     signal(SIGINT, sighandle);
     signal(SIGTERM, sighandle);
+    signal(SIGUSR1, sighandle);
 
     // B/W combo
     dbgc = bgc = BLACK;
     dfgc = fgc = WHITE;
     dugc = ugc = fgc;
 
-    // A safe default
-    wm_name = NULL;
-
     // Connect to the Xserver and initialize scr
     xconn();
 
-    while ((ch = getopt(argc, argv, "hg:o:bdf:a:pu:B:F:U:n:")) != -1) {
+    while ((ch = getopt(argc, argv, "hg:o:m:bdf:a:pu:B:F:U:n:C:P:xj:L:r:s:t:D:i:")) != -1) {
         switch (ch) {
             case 'h':
                 printf ("lemonbar version %s\n", VERSION);
-                printf ("usage: %s [-h | -g | -o | -b | -d | -f | -p | -n | -u | -B | -F]\n"
+                printf ("usage: %s [-h | -g | -o | -m | -b | -d | -f | -p | -n | -u | -B | -F | -C | -P | -x | -j | -L | -r | -s | -t | -D | -i]\n"
                         "\t-h Show this help\n"
                         "\t-g Set the bar geometry {width}x{height}+{xoffset}+{yoffset}\n"
                         "\t-o Add randr output by name\n"
+                        "\t-m Show the same content on the comma separated randr outputs\n"
                         "\t-b Put the bar at the bottom of the screen\n"
                         "\t-d Force docking (use this if your WM isn't EWMH compliant)\n"
                         "\t-f Set the font name to use\n"
@@ -1421,10 +6034,21 @@ main (int argc, char **argv)
                         "\t-n Set the WM_NAME atom to the specified value for this bar\n"
                         "\t-u Set the underline/overline height in pixels\n"
                         "\t-B Set background color in #AARRGGBB\n"
-                        "\t-F Set foreground color in #AARRGGBB\n", argv[0]);
+                        "\t-F Set foreground color in #AARRGGBB\n"
+                        "\t-C Set the size of the rendered text cache in KiB\n"
+                        "\t-P Set the color palette as a comma separated list of colors\n"
+                        "\t-x Draw the bar on the client side and upload it at once\n"
+                        "\t-j Draw the monitors in parallel using up to N threads, implies -x\n"
+                        "\t-L Set the maximum length of an input line in KiB\n"
+                        "\t-r Redraw the bar at most N times per second\n"
+                        "\t-s Accept the named block updates on the given unix socket\n"
+                        "\t-t Draw every input line through the given template\n"
+                        "\t-D Set the character separating the template fields\n"
+                        "\t-i Set the input format, either text or binary\n", argv[0]);
                 exit (EXIT_SUCCESS);
             case 'g': (void)parse_geometry_string(optarg, geom_v); break;
             case 'o': (void)parse_output_string(optarg); break;
+            case 'm': parse_mirror_string(optarg); break;
             case 'p': permanent = true; break;
             case 'n': wm_name = xstrdup(optarg); break;
             case 'b': topbar = false; break;
@@ -1434,6 +6058,26 @@ main (int argc, char **argv)
             case 'B': dbgc = bgc = parse_color(optarg, NULL, BLACK); break;
             case 'F': dfgc = fgc = parse_color(optarg, NULL, WHITE); break;
             case 'U': dugc = ugc = parse_color(optarg, NULL, fgc); break;
+            case 'C': cache.limit = strtoul(optarg, NULL, 10) * 1024; break;
+            case 'P': parse_palette_string(optarg); break;
+            case 'x': client_render = true; break;
+            case 'j': thread_count = strtoul(optarg, NULL, 10); client_render = true; break;
+            case 'L': input.limit = max(strtoul(optarg, NULL, 10), 1) * 1024; break;
+            case 'r': {
+                const unsigned long fps = strtoul(optarg, NULL, 10);
+                frame.interval = fps ? 1000000000L / (long)min(fps, 1000) : 0;
+                break;
+            }
+            case 's': ctl_path = optarg; break;
+            case 't': tmpl_src = optarg; break;
+            case 'D': tmpl.delim = *optarg; break;
+            case 'i':
+                if (strcmp(optarg, "text") && strcmp(optarg, "binary")) {
+                    fprintf(stderr, "Unknown input format \"%s\"\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                bin.enabled = !strcmp(optarg, "binary");
+                break;
         }
     }
 
@@ -1443,85 +6087,97 @@ main (int argc, char **argv)
     area_stack.ptr = xcalloc(10, sizeof(area_t));
 
     // Copy the geometry values in place
-    bw = geom_v[0];
+    bw = bw_geom = geom_v[0];
     bh = geom_v[1];
     bx = geom_v[2];
     by = geom_v[3];
 
     // Do the heavy lifting
-    init(wm_name);
-    // The string is strdup'd when the command line arguments are parsed
-    free(wm_name);
+    init();
+    if (bin.enabled && (tmpl_src || ctl_path)) {
+        fprintf(stderr, "The binary input can't be used along with -t or -s\n");
+        exit(EXIT_FAILURE);
+    }
+    // The default colors and the fonts are known by now
+    if (tmpl_src)
+        tmpl_compile(tmpl_src);
+    if (ctl_path)
+        ctl_open(ctl_path);
     // Get the fd to Xserver
     pollin[1].fd = xcb_get_file_descriptor(c);
+    pollin[2].fd = ctl.fd;
 
 #ifdef __OpenBSD__
-    if (pledge("stdio rpath", NULL) < 0) {
+    if (pledge(ctl.fd < 0 ? "stdio rpath" : "stdio rpath unix recvfd", NULL) < 0) {
         err(EXIT_FAILURE, "pledge failed");
     }
 #endif
 
     for (;;) {
         bool redraw = false;
+        bool reconfigure = false;
 
         // If connection is in error state, then it has been shut down.
-        if (xcb_connection_has_error(c))
+        if (xcb_connection_has_error(c) || quit)
             break;
 
-        if (poll(pollin, 2, -1) > 0) {
+        if (dump_stats) {
+            print_stats();
+            dump_stats = false;
+        }
+
+        for (int i = 0; i < CTL_CLIENTS; i++)
+            ring_slots[i].fd = ctl.clients[i].ring ? ctl.clients[i].ring_fd : -1;
+
+        // Wake up for the end of the frame interval or for the providers,
+        // whichever comes first
+        int timeout = frame_timeout();
+        const int prov_wait = prov_timeout();
+        if (prov_wait >= 0 && (timeout < 0 || prov_wait < timeout))
+            timeout = prov_wait;
+
+        if (poll(pollin, 3 + 2 * CTL_CLIENTS, timeout) > 0) {
             if (pollin[0].revents & POLLHUP) {      // No more data...
                 if (permanent) pollin[0].fd = -1;   // ...null the fd and continue polling :D
                 else break;                         // ...bail out
             }
             if (pollin[0].revents & POLLIN) { // New input, process it
-                while (true) {
-                    ssize_t r = read(STDIN_FILENO, input + input_offset,
-                            sizeof(input) - input_offset);
-                    if (r == 0) break;
-                    if (r < 0) {
-                        if (errno == EINTR) continue;
-                        exit(EXIT_FAILURE);
-                    }
-
-                    input_offset += r;
-
-                    // Try to find the last complete input line in the buffer.
-                    char *input_end = input + input_offset;
-                    char *last_nl = memrchr(input, '\n', input_end - input);
-
-                    if (last_nl) {
-                        char *prev_nl = (last_nl != input) ?
-                                memrchr(input, '\n', last_nl - 1 - input) : NULL;
-                        char *begin = prev_nl? prev_nl + 1: input;
-
-                        *last_nl = '\0';
-
-                        parse(begin);
-                        redraw = true;
-
-                        // Move the unparsed part back to the beginning.
-                        const size_t remaining = input_end - (last_nl + 1);
-                        if (remaining != 0) memmove(input, last_nl + 1, remaining);
-                        input_offset = remaining;
-
-                        break;
-                    }
-
-                    // The input buffer is full and we haven't seen a newline
-                    // yet, discard everything and start from zero.
-                    if (sizeof(input) == input_offset) {
-                        input_offset = 0;
-                    }
+                size_t len;
+                char *line = input_read(frame.interval != 0, &len);
+                if (line && ctl.fd >= 0)
+                    (void)ctl_block_set("stdin", line, len);
+                else if (line)
+                    redraw |= frame_submit(line, len);
+
+                if (input.eof) {
+                    if (permanent) pollin[0].fd = -1;
+                    else break;
                 }
             }
+            if (pollin[2].revents & POLLIN) // A new client for the control socket
+                ctl_accept(ctl_slots);
+            for (int i = 0; i < CTL_CLIENTS; i++) {
+                if (ctl_slots[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    ctl_read(&ctl_slots[i], &ctl.clients[i]);
+                // The client may have gone meanwhile, taking its ring along
+                if (ring_slots[i].revents & (POLLIN | POLLHUP | POLLERR) && ctl.clients[i].ring)
+                    ctl_ring_read(&ctl_slots[i], &ctl.clients[i]);
+            }
             if (pollin[1].revents & POLLIN) { // The event comes from the Xorg server
                 while ((ev = xcb_poll_for_event(c))) {
                     expose_ev = (xcb_expose_event_t *)ev;
 
                     switch (ev->response_type & 0x7F) {
                         case XCB_EXPOSE:
-                            if (expose_ev->count == 0)
-                                redraw = true;
+                            // Restore the exposed rectangle only
+                            for (monitor_t *mon = monhead; mon; mon = mon->next) {
+                                if (mon->window == expose_ev->window) {
+                                    xcb_copy_area(c, mon->pixmap, mon->window, gc_copy,
+                                            expose_ev->x, expose_ev->y, expose_ev->x, expose_ev->y,
+                                            expose_ev->width, expose_ev->height);
+                                    break;
+                                }
+                            }
                             break;
                         case XCB_BUTTON_PRESS:
                             press_ev = (xcb_button_press_event_t *)ev;
@@ -1534,6 +6190,12 @@ main (int argc, char **argv)
                                 }
                             }
                             break;
+                        default:
+                            if (randr_base &&
+                                    ((ev->response_type & 0x7F) == randr_base + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+                                     (ev->response_type & 0x7F) == randr_base + XCB_RANDR_NOTIFY))
+                                reconfigure = true;
+                            break;
                     }
 
                     free(ev);
@@ -1541,9 +6203,40 @@ main (int argc, char **argv)
             }
         }
 
-        if (redraw) { // Copy our temporary pixmap onto the window
+        // Draw the blocks changed through the control socket at once
+        if (ctl.dirty) {
+            ctl.dirty = false;
+            char *line = ctl_compose();
+            redraw |= frame_submit(line, strlen(line));
+        }
+
+        // The frame interval is over, draw the line held back if any
+        if (frame.armed && frame_timeout() == 0) {
+            frame.armed = false;
+            if (frame.pending) {
+                frame_parse(frame.line, frame.len);
+                frame.pending = false;
+                redraw = true;
+            }
+        }
+
+        if (prov_timeout() == 0)
+            redraw |= prov_refresh();
+
+        // Handle a burst of notifications at once
+        if (reconfigure) {
+            monitors_update();
+            redraw = true;
+        }
+
+        if (redraw) { // Copy the dirty parts of our temporary pixmap onto the window
             for (monitor_t *mon = monhead; mon; mon = mon->next) {
-                xcb_copy_area(c, mon->pixmap, mon->window, gc[GC_DRAW], 0, 0, 0, 0, mon->width, bh);
+                for (unsigned i = 0; i < mon->dirty_count; i++) {
+                    const span_t *s = &mon->dirty[i];
+                    xcb_copy_area(c, mon->pixmap, mon->window, gc_copy,
+                            s->begin, 0, s->begin, 0, s->end - s->begin, bh);
+                }
+                mon->dirty_count = 0;
             }
         }
 
@@ -0,0 +1,232 @@
+// vim:sw=4:ts=4:et:
+// The producer side of the shared memory ring, see lemonbar_ring.h
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "lemonbar_ring.h"
+
+struct lemonbar_ring_client {
+    int sock;
+    // The wakeup descriptor the producer writes to
+    int wake;
+    struct lemonbar_ring *ring;
+    size_t map_size;
+};
+
+static int
+ring_memory (size_t map_size)
+{
+    int fd;
+#ifdef __linux__
+    fd = memfd_create("lemonbar-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    char name[64];
+    int tries = 16;
+
+    // An anonymous object, unlinked as soon as it's created
+    do {
+        snprintf(name, sizeof(name), "/lemonbar-ring-%ld-%d", (long)getpid(), rand());
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    } while (fd < 0 && errno == EEXIST && --tries);
+    if (fd >= 0)
+        shm_unlink(name);
+#endif
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, (off_t)map_size) < 0) {
+        close(fd);
+        return -1;
+    }
+#ifdef __linux__
+    // The bar would fault on the pages cut off by a later truncation, it
+    // refuses the memory that isn't sealed
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+#endif
+
+    return fd;
+}
+
+// Hand the ring memory and the read side of the wakeup descriptor to the bar
+static int
+ring_attach (int sock, const char *block, int mem_fd, int wake_fd)
+{
+    char cmd[256];
+    int fds[2] = { mem_fd, wake_fd };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    int len = snprintf(cmd, sizeof(cmd), "ring %s\n", block);
+
+    if (len < 0 || (size_t)len >= sizeof(cmd) || strpbrk(block, " \n")) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct iovec iov = { .iov_base = cmd, .iov_len = (size_t)len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+    memset(ctrl.buf, 0, sizeof(ctrl.buf));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+lemonbar_ring_client *
+lemonbar_ring_open (const char *path, const char *block, size_t size)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    lemonbar_ring_client *client;
+    int mem_fd = -1, wake_rd = -1;
+    int err;
+
+    if ((size & (size - 1)) || size < LEMONBAR_RING_MIN || size > LEMONBAR_RING_MAX ||
+            strlen(path) >= sizeof(addr.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    client = calloc(1, sizeof(*client));
+    if (!client)
+        return NULL;
+    client->sock = client->wake = -1;
+    client->map_size = sizeof(struct lemonbar_ring) + size;
+
+    mem_fd = ring_memory(client->map_size);
+    if (mem_fd < 0)
+        goto fail;
+    client->ring = mmap(NULL, client->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (client->ring == MAP_FAILED) {
+        client->ring = NULL;
+        goto fail;
+    }
+    client->ring->magic = LEMONBAR_RING_MAGIC;
+    client->ring->size = (uint32_t)size;
+
+#ifdef __linux__
+    client->wake = wake_rd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (client->wake < 0)
+        goto fail;
+#else
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0)
+        goto fail;
+    wake_rd = pipe_fds[0];
+    client->wake = pipe_fds[1];
+    (void)fcntl(wake_rd, F_SETFD, FD_CLOEXEC);
+    (void)fcntl(client->wake, F_SETFD, FD_CLOEXEC);
+    // A full pipe already means the bar has something to read
+    (void)fcntl(client->wake, F_SETFL, O_NONBLOCK);
+#endif
+
+    client->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->sock < 0)
+        goto fail;
+    (void)fcntl(client->sock, F_SETFD, FD_CLOEXEC);
+    if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+    if (ring_attach(client->sock, block, mem_fd, wake_rd) < 0)
+        goto fail;
+
+    // The bar holds its own references from now on
+    close(mem_fd);
+    if (wake_rd != client->wake)
+        close(wake_rd);
+
+    return client;
+
+fail:
+    err = errno;
+    if (mem_fd >= 0)
+        close(mem_fd);
+    if (wake_rd >= 0 && wake_rd != client->wake)
+        close(wake_rd);
+    lemonbar_ring_close(client);
+    errno = err;
+    return NULL;
+}
+
+int
+lemonbar_ring_push (lemonbar_ring_client *client, const char *line, size_t len)
+{
+    struct lemonbar_ring *ring = client->ring;
+    const uint64_t size = ring->size;
+    const uint64_t entry = LEMONBAR_RING_ENTRY(len);
+
+    // Half the ring is enough to make room for any entry once the bar caught up
+    if (entry > size / 2) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint64_t off = head & (size - 1);
+    uint64_t skip = (size - off < entry) ? size - off : 0;
+
+    if (size - (head - tail) < skip + entry) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (skip) {
+        uint32_t wrap = LEMONBAR_RING_WRAP;
+        memcpy(ring->data + off, &wrap, sizeof(wrap));
+        off = 0;
+    }
+
+    uint32_t len32 = (uint32_t)len;
+    memcpy(ring->data + off, &len32, sizeof(len32));
+    memcpy(ring->data + off + 4, line, len);
+    ring->data[off + 4 + len] = '\0';
+
+    // Publish the entry, then poke the bar
+    __atomic_store_n(&ring->head, head + skip + entry, __ATOMIC_RELEASE);
+
+#ifdef __linux__
+    uint64_t one = 1;
+    (void)write(client->wake, &one, sizeof(one));
+#else
+    (void)write(client->wake, "", 1);
+#endif
+
+    return 0;
+}
+
+void
+lemonbar_ring_close (lemonbar_ring_client *client)
+{
+    if (!client)
+        return;
+
+    if (client->sock >= 0)
+        close(client->sock);
+    if (client->wake >= 0)
+        close(client->wake);
+    if (client->ring)
+        munmap(client->ring, client->map_size);
+    free(client);
+}
@@ -0,0 +1,62 @@
+#ifndef LEMONBAR_RING_H_
+#define LEMONBAR_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A single-producer single-consumer ring of lines shared with lemonbar.
+//
+// The producer maps a shared memory object holding the header below followed
+// by `size` bytes of data and hands it to the bar along with an eventfd (or
+// the read end of a pipe) through the control socket:
+//
+//   ring NAME
+//
+// sent with both descriptors attached as SCM_RIGHTS, the ring then feeds the
+// block NAME until the connection is closed. Where file sealing is available
+// the memory must carry the F_SEAL_SHRINK and F_SEAL_SEAL seals.
+//
+// Every entry is a 32 bit length followed by the line and its NUL terminator,
+// padded to 8 bytes. An entry never wraps around the end of the data, the
+// producer writes a LEMONBAR_RING_WRAP length in its place and starts again
+// from the beginning. `head` and `tail` count the bytes ever written and
+// consumed, the producer only stores `head` and the consumer only `tail`.
+
+#define LEMONBAR_RING_MAGIC 0x6c726e67u
+#define LEMONBAR_RING_WRAP  0xffffffffu
+// The ring data size is a power of two within these bounds
+#define LEMONBAR_RING_MIN   256u
+#define LEMONBAR_RING_MAX   (64u << 20)
+
+#define LEMONBAR_RING_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+// Bytes taken by an entry carrying a line of `len` bytes
+#define LEMONBAR_RING_ENTRY(len) LEMONBAR_RING_ALIGN(4 + (uint64_t)(len) + 1)
+
+struct lemonbar_ring {
+    uint32_t magic;
+    uint32_t size;
+    // Keep the two counters on their own cache lines
+    char pad0[56];
+    uint64_t head;
+    char pad1[56];
+    uint64_t tail;
+    char pad2[56];
+    unsigned char data[];
+};
+
+// The client side, see lemonbar_ring.c
+
+typedef struct lemonbar_ring_client lemonbar_ring_client;
+
+// Connect to the bar listening on `path` and attach a ring of `size` bytes
+// feeding the block `block`, which must have been defined already. Returns
+// NULL and sets errno on failure.
+lemonbar_ring_client *lemonbar_ring_open (const char *path, const char *block, size_t size);
+// Queue a line, without the trailing newline, and wake the bar up. Returns -1
+// and sets errno to EAGAIN if the bar hasn't caught up yet, or to EMSGSIZE if
+// the line can't ever fit.
+int lemonbar_ring_push (lemonbar_ring_client *client, const char *line, size_t len);
+// Detach the ring, the bar keeps showing the last line pushed
+void lemonbar_ring_close (lemonbar_ring_client *client);
+
+#endif
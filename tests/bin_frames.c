@@ -0,0 +1,89 @@
+// vim:sw=4:ts=4:et:
+// Draw a binary frame with a clickable area, drop a malformed frame coming
+// after it and check that the click still resolves to the command on screen.
+// Needs an X server, exits with 77 when there's none.
+#define main lemonbar_main
+#include "../lemonbar.c"
+#undef main
+
+static size_t
+put_u32 (char *buf, const uint32_t v)
+{
+    memcpy(buf, &v, 4);
+    return 4;
+}
+
+// An area with the given command spanning the given width
+static size_t
+frame_area (char *buf, const char *cmd, const uint32_t width)
+{
+    size_t len = 0;
+
+    buf[len++] = 'A';
+    buf[len++] = 1;
+    len += put_u32(buf + len, (uint32_t)strlen(cmd));
+    memcpy(buf + len, cmd, strlen(cmd));
+    len += strlen(cmd);
+    buf[len++] = 'O';
+    len += put_u32(buf + len, width);
+    buf[len++] = 'a';
+
+    return len;
+}
+
+int
+main (void)
+{
+    char good[256], bad[4096];
+    size_t good_len, bad_len;
+
+    if (!getenv("DISPLAY")) {
+        fprintf(stderr, "No X server, skipped\n");
+        return 77;
+    }
+
+    dbgc = bgc = BLACK;
+    dfgc = fgc = WHITE;
+    dugc = ugc = fgc;
+    xconn();
+
+    area_stack.alloc = 10;
+    area_stack.ptr = xcalloc(10, sizeof(area_t));
+    bw = bw_geom = -1;
+    bh = -1;
+    bin.enabled = true;
+    init();
+
+    good_len = frame_area(good, "first", 100);
+    bin_run(good, good_len);
+
+    // A frame that fits in the buffers sized for the first one and one that
+    // doesn't, both cut short after their areas
+    bad_len = frame_area(bad, "wrong", 100);
+    bad[bad_len++] = 'X';
+    bin_run(bad, bad_len);
+
+    bad_len = 0;
+    for (int i = 0; i < 8; i++) {
+        char cmd[200];
+        memset(cmd, 'a' + i, sizeof(cmd) - 1);
+        cmd[sizeof(cmd) - 1] = '\0';
+        bad_len += frame_area(bad + bad_len, cmd, 10);
+    }
+    bad[bad_len++] = 'X';
+    bad_len += put_u32(bad + bad_len, 1000);
+    bin_run(bad, bad_len);
+
+    if (input.dropped != 2) {
+        fprintf(stderr, "The malformed frames haven't been dropped\n");
+        return EXIT_FAILURE;
+    }
+
+    const area_t *area = area_get(monhead->window, XCB_BUTTON_INDEX_1, 50);
+    if (!area || strcmp(area->cmd, "first")) {
+        fprintf(stderr, "The click resolved to \"%s\" instead of \"first\"\n", area ? area->cmd : "(nothing)");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
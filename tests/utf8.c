@@ -0,0 +1,178 @@
+// vim:sw=4:ts=4:et:
+// Check the UTF-8 decoder against a plain reference implementation, with every
+// ASCII fast path the cpu supports. Needs no X server.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../utf8.c"
+
+// Decode a sequence the long way: gather the continuation bytes, then reject
+// the overlong forms, the surrogates and the codepoints past U+10FFFF
+static size_t
+ref_decode_one (const uint8_t *s, const uint8_t *end, uint32_t *out)
+{
+    static const uint32_t min_cp[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    size_t n;
+    uint32_t cp;
+
+    if (s[0] < 0x80) {
+        *out = s[0];
+        return 1;
+    }
+
+    if ((s[0] & 0xe0) == 0xc0)      { n = 2; cp = s[0] & 0x1f; }
+    else if ((s[0] & 0xf0) == 0xe0) { n = 3; cp = s[0] & 0x0f; }
+    else if ((s[0] & 0xf8) == 0xf0) { n = 4; cp = s[0] & 0x07; }
+    else goto invalid;
+
+    if ((size_t)(end - s) < n)
+        goto invalid;
+
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            goto invalid;
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+
+    if (cp < min_cp[n] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+        goto invalid;
+
+    *out = cp;
+    return n;
+
+invalid:
+    *out = s[0];
+    return 1;
+}
+
+static size_t
+ref_decode (const uint8_t *s, size_t len, uint32_t *out)
+{
+    const uint8_t *end = s + len;
+    size_t n = 0;
+
+    while (s < end)
+        s += ref_decode_one(s, end, &out[n++]);
+
+    return n;
+}
+
+static struct {
+    const char *name;
+    size_t (*fn) (const uint8_t *, size_t, uint32_t *);
+    bool usable;
+} impls[] = {
+    { "scalar", ascii_run_scalar, true },
+#if HAVE_X86_SIMD
+    { "sse2", ascii_run_sse2, false },
+    { "avx2", ascii_run_avx2, false },
+#endif
+};
+
+static int failures;
+
+// Decode the text with every usable fast path and compare the outcome
+static void
+expect (const char *what, const uint8_t *s, size_t len, const uint32_t *want, size_t want_n)
+{
+    uint32_t *got = calloc(len + 1, sizeof(uint32_t));
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (!impls[k].usable)
+            continue;
+
+        ascii_run = impls[k].fn;
+        const size_t got_n = utf8_decode((const char *)s, len, got);
+
+        if (got_n != want_n || memcmp(got, want, want_n * sizeof(uint32_t))) {
+            fprintf(stderr, "%s: %s decoded %zu codepoints, expected %zu\n",
+                    what, impls[k].name, got_n, want_n);
+            failures++;
+        }
+    }
+
+    free(got);
+}
+
+static void
+check (const char *what, const uint8_t *s, size_t len)
+{
+    uint32_t *want = calloc(len + 1, sizeof(uint32_t));
+
+    expect(what, s, len, want, ref_decode(s, len, want));
+    free(want);
+}
+
+// The invalid sequences yield their first byte, the decoding starts over from
+// the next one
+#define KNOWN(what, s, ...) do { \
+    const uint32_t want[] = { __VA_ARGS__ }; \
+    expect(what, (const uint8_t *)(s), strlen(s), want, sizeof(want) / sizeof(want[0])); \
+} while (0)
+
+int
+main (void)
+{
+    uint8_t buf[512];
+
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    impls[1].usable = __builtin_cpu_supports("sse2");
+    impls[2].usable = __builtin_cpu_supports("avx2");
+#endif
+
+    KNOWN("ascii", "ab", 'a', 'b');
+    KNOWN("two bytes", "\xc3\xa9", 0xe9);
+    KNOWN("three bytes", "\xe2\x82\xac", 0x20ac);
+    KNOWN("four bytes", "\xf0\x9d\x84\x9e", 0x1d11e);
+    KNOWN("highest", "\xf4\x8f\xbf\xbf", 0x10ffff);
+    KNOWN("overlong two", "\xc0\x80", 0xc0, 0x80);
+    KNOWN("overlong three", "\xe0\x80\xaf", 0xe0, 0x80, 0xaf);
+    KNOWN("overlong four", "\xf0\x80\x80\xaf", 0xf0, 0x80, 0x80, 0xaf);
+    KNOWN("surrogate", "\xed\xa0\x80", 0xed, 0xa0, 0x80);
+    KNOWN("past U+10FFFF", "\xf4\x90\x80\x80", 0xf4, 0x90, 0x80, 0x80);
+    KNOWN("bad lead", "\xf8\x88\x80\x80\x80", 0xf8, 0x88, 0x80, 0x80, 0x80);
+    KNOWN("truncated", "a\xe2\x82", 'a', 0xe2, 0x82);
+    KNOWN("truncated four", "\xf0\x9d\x84", 0xf0, 0x9d, 0x84);
+    KNOWN("bad continuation", "\xe2\x28\xa1", 0xe2, '(', 0xa1);
+
+    // ASCII runs ending on both sides of the 16 and 32 byte boundaries,
+    // followed by a multibyte sequence or by one cut short at the end
+    for (size_t run = 0; run < 80; run++) {
+        for (size_t shift = 0; shift < 4; shift++) {
+            uint8_t *s = buf + shift;
+
+            memset(s, 'x', run);
+            memcpy(s + run, "\xe2\x82\xac", 3);
+            check("ascii run", s, run + 3);
+            check("ascii run cut short", s, run + 2);
+            memset(s + run + 3, 'y', run);
+            check("ascii runs", s, 2 * run + 3);
+        }
+    }
+
+    // Random soup of ASCII runs, valid sequences and garbage
+    static const char *pieces[] = {
+        "a", "0123456789abcdef", "0123456789abcdef0123456789abcdef",
+        "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9d\x84\x9e", "\xc0\x80", "\xed\xa0\x80",
+        "\xf4\x90\x80\x80", "\xe2\x82", "\x80", "\xff", "\xf0",
+    };
+    srand(1);
+    for (int i = 0; i < 20000; i++) {
+        size_t len = 0;
+
+        while (len < sizeof(buf) - 40 && rand() % 16) {
+            const char *p = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+            memcpy(buf + len, p, strlen(p));
+            len += strlen(p);
+        }
+
+        check("random", buf, len);
+        // Cut the text anywhere to leave a sequence truncated at the end
+        if (len)
+            check("random truncated", buf, rand() % len);
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+// vim:sw=4:ts=4:et:
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Decode a single multibyte sequence, returns the number of bytes consumed.
+// The overlong forms, the surrogates and the truncated sequences are rejected,
+// in that case the first byte is taken as it is (Latin-1) and the decoding
+// restarts from the following one.
+static size_t
+decode_one (const uint8_t *s, const uint8_t *end, uint32_t *out)
+{
+    const size_t avail = end - s;
+    uint8_t lo = 0x80, hi = 0xbf;
+    uint32_t cp;
+    size_t n;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        n = 2;
+        cp = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        n = 3;
+        cp = s[0] & 0x0f;
+        if (s[0] == 0xe0) lo = 0xa0;
+        if (s[0] == 0xed) hi = 0x9f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        n = 4;
+        cp = s[0] & 0x07;
+        if (s[0] == 0xf0) lo = 0x90;
+        if (s[0] == 0xf4) hi = 0x8f;
+    } else {
+        goto invalid;
+    }
+
+    // The range of the second byte takes care of the overlong forms, of the
+    // surrogates and of the codepoints past U+10FFFF
+    if (avail < n || s[1] < lo || s[1] > hi)
+        goto invalid;
+
+    cp = cp << 6 | (s[1] & 0x3f);
+    for (size_t i = 2; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            goto invalid;
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+
+    *out = cp;
+    return n;
+
+invalid:
+    *out = s[0];
+    return 1;
+}
+
+// Widen the leading run of ASCII characters, returns its length.
+static size_t
+ascii_run_scalar (const uint8_t *s, size_t len, uint32_t *out)
+{
+    size_t i = 0;
+
+    while (i < len && s[i] < 0x80) {
+        out[i] = s[i];
+        i++;
+    }
+
+    return i;
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t
+ascii_run_sse2 (const uint8_t *s, size_t len, uint32_t *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+        // Stop at the first byte having the high bit set
+        if (_mm_movemask_epi8(v))
+            break;
+
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+        _mm_storeu_si128((__m128i *)(out + i + 0), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+
+    return i + ascii_run_scalar(s + i, len - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+ascii_run_avx2 (const uint8_t *s, size_t len, uint32_t *out)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+        if (_mm256_movemask_epi8(v))
+            break;
+
+        for (int k = 0; k < 4; k++) {
+            const __m128i b = _mm_loadl_epi64((const __m128i *)(s + i + 8 * k));
+            _mm256_storeu_si256((__m256i *)(out + i + 8 * k), _mm256_cvtepu8_epi32(b));
+        }
+    }
+
+    return i + ascii_run_sse2(s + i, len - i, out + i);
+}
+#endif
+
+static size_t (*ascii_run) (const uint8_t *, size_t, uint32_t *);
+
+// Decode len bytes of UTF-8 text into dst, which must have room for len
+// codepoints. Returns the number of codepoints written.
+size_t
+utf8_decode (const char *src, size_t len, uint32_t *dst)
+{
+    const uint8_t *s = (const uint8_t *)src, *end = s + len;
+    uint32_t *out = dst;
+
+    // Pick the widest implementation the cpu supports
+    if (!ascii_run) {
+        ascii_run = ascii_run_scalar;
+#if HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            ascii_run = ascii_run_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            ascii_run = ascii_run_sse2;
+#endif
+    }
+
+    while (s < end) {
+        const size_t n = ascii_run(s, end - s, out);
+
+        s += n;
+        out += n;
+
+        if (s < end)
+            s += decode_one(s, end, out++);
+    }
+
+    return out - dst;
+}
@@ -0,0 +1,9 @@
+#ifndef UTF8_H_
+#define UTF8_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t utf8_decode(const char *src, size_t len, uint32_t *dst);
+
+#endif
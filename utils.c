@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,3 +54,14 @@ xreallocarray(void *ptr, size_t nmemb, size_t size)
     if (p == NULL) oom_error(__func__);
     return p;
 }
+
+uint64_t
+fnv1a (const void *data, size_t len, uint64_t hash)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
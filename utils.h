@@ -1,10 +1,16 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 char* xstrdup(const char *s);
 void* xmalloc(size_t size);
 void* xcalloc(size_t nmemb, size_t size);
 void* xrealloc(void *ptr, size_t size);
 void* xreallocarray(void *ptr, size_t nmemb, size_t size);
 
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+uint64_t fnv1a(const void *data, size_t len, uint64_t hash);
+
 #endif